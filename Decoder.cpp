@@ -27,6 +27,7 @@ Decoder::Decoder(int width, int height)
   img.width = width;
   img.height = height;
   img.channels = 3;
+  subsampled = false;
   img.imagedata = new PixelValue[width * height];
   img.imagedata2 = new PixelValue[width * height];
   img.imagedata3 = new PixelValue[width * height];
@@ -49,6 +50,7 @@ void Decoder::Decode(Transforms* transforms)
   Transform::iterator iter;
 
   img.channels = transforms->channels;
+  subsampled = transforms->subsampled;
 
   for (int channel = 1; channel <= img.channels; channel++)
     {
@@ -58,10 +60,15 @@ void Decoder::Decode(Transforms* transforms)
       else if (channel == 3)
         origImage = img.imagedata3;
 
+      // Subsampled planes use the start of the buffer
+      int width = img.width;
+      if (channel >= 2 && subsampled)
+        width /= 2;
+
       // Apple each transform at a time to this channel
       iter = transforms->ch[channel-1].begin();
       for (; iter != transforms->ch[channel-1].end(); iter++)
-        iter[0]->Execute(origImage, img.width, origImage, img.width, false);
+        iter[0]->Execute(origImage, width, origImage, width, false);
     }
 }
 
@@ -69,14 +76,56 @@ Image* Decoder::GetNewImage(string fileName, int channel)
 {
   Image* temp = new Image(fileName);
   int size = img.width * img.height;
+  PixelValue* chroma[2] = { img.imagedata2, img.imagedata3 };
+
+  // Bring subsampled channels back to full size
+  if (subsampled)
+    for (int i = 0; i < 2; i++)
+      {
+        chroma[i] = new PixelValue[size];
+        UpSample(i ? img.imagedata3 : img.imagedata2, img.width / 2, img.height / 2, chroma[i]);
+      }
 
   // Get according to channel number or all channels if number is zero
   if (img.channels >= 1 && (!channel || channel == 1))
     temp->SetChannelData(1, img.imagedata, size);
   if (img.channels >= 2 && (!channel || channel == 2))
-    temp->SetChannelData((!channel ? 2 : 1), img.imagedata2, size);
+    temp->SetChannelData((!channel ? 2 : 1), chroma[0], size);
   if (img.channels >= 3 && (!channel || channel == 3))
-    temp->SetChannelData((!channel ? 3 : 1), img.imagedata3, size);
+    temp->SetChannelData((!channel ? 3 : 1), chroma[1], size);
+
+  if (subsampled)
+    {
+      delete []chroma[0];
+      delete []chroma[1];
+    }
 
   return temp;
 }
+
+/*
+  Double the width and height of an image. Every new pixel weighs the
+  source pixel it lies in 3/4 and its neighbour towards it 1/4 along
+  each axis, the inverse of the encoder's 2x2 average. Edges repeat.
+*/
+void Decoder::UpSample(PixelValue* src, int srcWidth, int srcHeight, PixelValue* dest)
+{
+  for (int y = 0; y < srcHeight * 2; y++)
+    {
+      int y0 = y / 2;
+      int y1 = (y & 1) ? y0 + 1 : y0 - 1;
+      if (y1 < 0 || y1 >= srcHeight)
+        y1 = y0;
+
+      for (int x = 0; x < srcWidth * 2; x++)
+        {
+          int x0 = x / 2;
+          int x1 = (x & 1) ? x0 + 1 : x0 - 1;
+          if (x1 < 0 || x1 >= srcWidth)
+            x1 = x0;
+
+          dest[y * srcWidth * 2 + x] = (9 * src[y0 * srcWidth + x0] + 3 * src[y0 * srcWidth + x1] +
+                                        3 * src[y1 * srcWidth + x0] + src[y1 * srcWidth + x1] + 8) / 16;
+        }
+    }
+}
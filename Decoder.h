@@ -30,8 +30,14 @@ class Decoder
 
   Image* GetNewImage(string fileName, int channel);
 
+ protected:
+  static void UpSample(PixelValue* src, int srcWidth, int srcHeight, PixelValue* dest);
+
  protected:
   ImageData img;
+
+  // Channels 2 and 3 hold half size planes, see Transforms::subsampled.
+  bool subsampled;
 };
 
 #endif // DEC_H
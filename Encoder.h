@@ -17,8 +17,6 @@
 #ifndef E_H
 #define E_H
 
-#define N_THREADS 4
-
 class Encoder
 {
  public:
@@ -29,6 +27,15 @@ class Encoder
 
   virtual Transforms* Encode(Image* source) = 0;
 
+  // Start the encoder's OpenMP threads, see threads and pinThreads.
+  // Returns the number of threads.
+  int StartThreads();
+
+  // Threads used to encode (0 means one per CPU) and whether each
+  // thread is pinned to a CPU of its own.
+  int threads;
+  bool pinThreads;
+
   // These functions are helpers
   int GetAveragePixel(PixelValue* domainData, int domainWidth,
                       int domainX, int domainY, int size);
@@ -38,12 +45,21 @@ class Encoder
                         PixelValue* rangeData, int rangeWidth, int rangeX, int rangeY, int rangeAvg,
                         int size);
 
+  // Stops early once the error cannot be below bestError; the value
+  // returned is then only known to be at least bestError.
   double GetError(
                   PixelValue* domainData, int domainWidth, int domainX, int domainY, int domainAvg,
                   PixelValue* rangeData, int rangeWidth, int rangeX, int rangeY, int rangeAvg,
-                  int size, double scale);
+                  int size, double scale, double bestError);
+
+  int GetCrossCorrelation(
+                          PixelValue* domainData, int domainWidth, int domainX, int domainY,
+                          PixelValue* rangeData, int rangeWidth, int rangeX, int rangeY,
+                          int size);
 
-  unsigned int **temp_ints;
+  double GetFit(int size, int domainSum, int domainSum2, int domainAvg,
+                int rangeSum, int rangeSum2, int rangeAvg,
+                int correlation, double& scale);
 
  protected:
   ImageData img;
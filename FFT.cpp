@@ -0,0 +1,177 @@
+/*
+ * Fractal Image Compression. Copyright 2004 Alex Kennberg.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+using namespace std;
+
+#include "FFT.h"
+
+FFT::FFT()
+{
+  width = height = size = 0;
+}
+
+void FFT::Init(int width, int height)
+{
+  this->width = width;
+  this->height = height;
+  size = max(width, height);
+
+  cosines.resize(size / 2);
+  sines.resize(size / 2);
+  for (int k = 0; k < size / 2; k++)
+    {
+      cosines[k] = cos(-2 * M_PI * k / size);
+      sines[k] = sin(-2 * M_PI * k / size);
+    }
+}
+
+/*
+  In place transform of n rows of count values each, that is of count
+  columns at once: every butterfly combines whole rows, which reads
+  memory in order and vectorizes. Stages go two at a time, four rows
+  per butterfly, to halve the passes over the array.
+*/
+void FFT::transform(double* re, double* im, int n, int count, bool inverse) const
+{
+  // Bit reversed order
+  for (int i = 1, j = 0; i < n; i++)
+    {
+      int bit = n >> 1;
+      for (; j & bit; bit >>= 1)
+        j ^= bit;
+      j ^= bit;
+      if (i < j)
+        {
+          swap_ranges(re + i * count, re + (i + 1) * count, re + j * count);
+          swap_ranges(im + i * count, im + (i + 1) * count, im + j * count);
+        }
+    }
+
+  double sign = inverse ? -1 : 1;
+  int len = 2;
+  for (; len * 2 <= n; len <<= 2)
+    {
+      int half = len / 2;
+      int step = size / len;
+      for (int i = 0; i < n; i += len * 2)
+        for (int k = 0; k < half; k++)
+          {
+            // Stage len pairs rows 0-1 and 2-3, stage 2 * len 0-2 and 1-3
+            double w1r = cosines[k * step];
+            double w1i = sign * sines[k * step];
+            double w2r = cosines[k * step / 2];
+            double w2i = sign * sines[k * step / 2];
+            double w3r = cosines[(k + half) * step / 2];
+            double w3i = sign * sines[(k + half) * step / 2];
+            double* __restrict r0 = re + (i + k) * count;
+            double* __restrict i0 = im + (i + k) * count;
+            double* __restrict r1 = re + (i + k + half) * count;
+            double* __restrict i1 = im + (i + k + half) * count;
+            double* __restrict r2 = re + (i + k + len) * count;
+            double* __restrict i2 = im + (i + k + len) * count;
+            double* __restrict r3 = re + (i + k + len + half) * count;
+            double* __restrict i3 = im + (i + k + len + half) * count;
+            for (int x = 0; x < count; x++)
+              {
+                double tr = r1[x] * w1r - i1[x] * w1i;
+                double ti = r1[x] * w1i + i1[x] * w1r;
+                double a0r = r0[x] + tr, a0i = i0[x] + ti;
+                double a1r = r0[x] - tr, a1i = i0[x] - ti;
+                tr = r3[x] * w1r - i3[x] * w1i;
+                ti = r3[x] * w1i + i3[x] * w1r;
+                double a2r = r2[x] + tr, a2i = i2[x] + ti;
+                double a3r = r2[x] - tr, a3i = i2[x] - ti;
+
+                tr = a2r * w2r - a2i * w2i;
+                ti = a2r * w2i + a2i * w2r;
+                r0[x] = a0r + tr;
+                i0[x] = a0i + ti;
+                r2[x] = a0r - tr;
+                i2[x] = a0i - ti;
+                tr = a3r * w3r - a3i * w3i;
+                ti = a3r * w3i + a3i * w3r;
+                r1[x] = a1r + tr;
+                i1[x] = a1i + ti;
+                r3[x] = a1r - tr;
+                i3[x] = a1i - ti;
+              }
+          }
+    }
+
+  // The last stage on its own when there is an odd number of them
+  for (; len <= n; len <<= 1)
+    {
+      int step = size / len;
+      for (int i = 0; i < n; i += len)
+        for (int k = 0; k < len / 2; k++)
+          {
+            double wr = cosines[k * step];
+            double wi = sign * sines[k * step];
+            double* __restrict ar = re + (i + k) * count;
+            double* __restrict ai = im + (i + k) * count;
+            double* __restrict br = re + (i + k + len / 2) * count;
+            double* __restrict bi = im + (i + k + len / 2) * count;
+            for (int x = 0; x < count; x++)
+              {
+                double tr = br[x] * wr - bi[x] * wi;
+                double ti = br[x] * wi + bi[x] * wr;
+                br[x] = ar[x] - tr;
+                bi[x] = ai[x] - ti;
+                ar[x] += tr;
+                ai[x] += ti;
+              }
+          }
+    }
+}
+
+// Copy a width x height array into its transpose, a tile at a time so
+// that the power of two strides do not thrash the cache.
+static void transpose(const double* src, int width, int height, double* dest)
+{
+  for (int y0 = 0; y0 < height; y0 += 16)
+    for (int x0 = 0; x0 < width; x0 += 16)
+      for (int y = y0; y < min(y0 + 16, height); y++)
+        for (int x = x0; x < min(x0 + 16, width); x++)
+          dest[x * height + y] = src[y * width + x];
+}
+
+// Transform the first rows rows along x, as columns of their transpose.
+void FFT::transformRows(double* re, double* im, int rows, bool inverse, double* scratch) const
+{
+  double* tr = scratch;
+  double* ti = scratch + width * rows;
+
+  transpose(re, width, rows, tr);
+  transpose(im, width, rows, ti);
+  transform(tr, ti, width, rows, inverse);
+  transpose(tr, rows, width, re);
+  transpose(ti, rows, width, im);
+}
+
+void FFT::Forward(double* re, double* im, int rows, double* scratch) const
+{
+  transformRows(re, im, rows, false, scratch);
+  transform(re, im, height, width, false);
+}
+
+void FFT::Inverse(double* re, double* im, int rows, double* scratch) const
+{
+  transform(re, im, height, width, true);
+  transformRows(re, im, rows, true, scratch);
+}
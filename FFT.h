@@ -0,0 +1,59 @@
+/*
+ * Fractal Image Compression. Copyright 2004 Alex Kennberg.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FFT_H
+#define FFT_H
+
+/*
+  Radix-2 FFT of width x height complex arrays, both sizes powers of
+  two. Real and imaginary parts are separate arrays stored row by row.
+  Rows that are known to be zero on input, or that are not wanted on
+  output, are skipped. Callers pass scratch room for 2 * width * height
+  values, so that threads can share one FFT.
+*/
+class FFT
+{
+ public:
+
+  FFT();
+
+  void Init(int width, int height);
+
+  // Forward transform of an array whose rows from `rows` on are zero.
+  void Forward(double* re, double* im, int rows, double* scratch) const;
+
+  // Inverse transform, without the 1 / (width * height) factor, that
+  // only computes the first `rows` rows of the result.
+  void Inverse(double* re, double* im, int rows, double* scratch) const;
+
+  int width;
+  int height;
+
+ private:
+
+  void transform(double* re, double* im, int n, int count, bool inverse) const;
+
+  void transformRows(double* re, double* im, int rows, bool inverse, double* scratch) const;
+
+ private:
+
+  // cos and sin of -2 pi k / size for k < size / 2, size the larger side
+  vector<double> cosines;
+  vector<double> sines;
+  int size;
+};
+
+#endif // FFT_H
@@ -22,6 +22,7 @@ using namespace std;
 
 #include "Image.h"
 #include "IFSTransform.h"
+#include "Kernels.h"
 #include "count_ops.h"
 
 extern int verb;
@@ -32,6 +33,7 @@ extern int verb;
 Transforms::Transforms()
 {
   channels = 0;
+  subsampled = false;
 }
 
 Transforms::~Transforms()
@@ -52,29 +54,10 @@ PixelValue* IFSTransform::DownSample(PixelValue* src, int srcWidth,
                                      int startX, int startY, int targetSize)
 {
   PixelValue* dest = new PixelValue[targetSize * targetSize];
-  int destX = 0;
-  int destY = 0;
 
-  for (int y = startY; y < startY + targetSize * 2; y += 2)
-    {
-      for (int x = startX; x < startX + targetSize * 2; x += 2)
-        {
-          // Perform simple 2x2 average
-          int pixel = 0;
-          INC_OP2(5, downsample_i);
-          pixel += src[y * srcWidth + x];
-          pixel += src[y * srcWidth + (x + 1)];
-          pixel += src[(y + 1) * srcWidth + x];
-          pixel += src[(y + 1) * srcWidth + (x + 1)];
-          pixel /= 4;
-
-          INC_OP2(1, downsample_i);
-          dest[destY * targetSize + destX] = pixel;
-          destX++;
-        }
-      destY++;
-      destX = 0;
-    }
+  // Perform simple 2x2 average
+  INC_OP2(6 * targetSize * targetSize, downsample_i);
+  kernels.DownSample(src + startY * srcWidth + startX, srcWidth, dest, targetSize);
 
   return dest;
 }
@@ -130,50 +113,65 @@ PixelValue IFSTransform::Execute(PixelValue* src, int srcWidth,
   int startX = fromX;
   int startY = fromY;
 
-  PixelValue accum = 0;
+  int accum = 0;
 
-  for (int toY = this->toY; toY < (this->toY + size); toY++)
+  if (inOrder && dX == 1 && verb < 4)
     {
-      for (int toX = this->toX; toX < (this->toX + size); toX++)
-        {
-          if (verb >= 4)
-            {
-              printf("toX=%d\n", toX);
-              printf("toY=%d\n", toY);
-              printf("fromX=%d\n", fromX);
-              printf("fromY=%d\n", fromY);
-            }
-          INC_OP2(2, execute_i);
-          int pixel = src[fromY * srcWidth + fromX];
-          pixel = (int)(scale * pixel) + offset;
-
-          if (pixel < 0)
-            pixel = 0;
-          if (pixel > 255)
-            pixel = 255;
-
-          if (verb >= 4)
-            printf("pixel=%d\n", pixel);
-
-          dest[toY * destWidth + toX] = pixel;
-          accum += pixel;
-
-         if (inOrder){
-            fromX += dX;
-         }else{
-            fromY += dY;
-         }
-        }
-
-      if (inOrder)
+      // Source rows are read left to right, map them a row at a time.
+      for (int toY = this->toY; toY < (this->toY + size); toY++)
         {
-          fromX = startX;
+          INC_OP2(2 * size, execute_i);
+          accum += kernels.ScaleRow(src + fromY * srcWidth + fromX,
+                                    dest + toY * destWidth + this->toX,
+                                    size, scale, offset);
           fromY += dY;
         }
-      else
+    }
+  else
+    {
+      for (int toY = this->toY; toY < (this->toY + size); toY++)
         {
-          fromY = startY;
-          fromX += dX;
+          for (int toX = this->toX; toX < (this->toX + size); toX++)
+            {
+              if (verb >= 4)
+                {
+                  printf("toX=%d\n", toX);
+                  printf("toY=%d\n", toY);
+                  printf("fromX=%d\n", fromX);
+                  printf("fromY=%d\n", fromY);
+                }
+              INC_OP2(2, execute_i);
+              int pixel = src[fromY * srcWidth + fromX];
+              pixel = (int)(scale * pixel) + offset;
+
+              if (pixel < 0)
+                pixel = 0;
+              if (pixel > 255)
+                pixel = 255;
+
+              if (verb >= 4)
+                printf("pixel=%d\n", pixel);
+
+              dest[toY * destWidth + toX] = pixel;
+              accum += pixel;
+
+             if (inOrder){
+                fromX += dX;
+             }else{
+                fromY += dY;
+             }
+            }
+
+          if (inOrder)
+            {
+              fromX = startX;
+              fromY += dY;
+            }
+          else
+            {
+              fromY = startY;
+              fromX += dX;
+            }
         }
     }
 
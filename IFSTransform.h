@@ -29,6 +29,9 @@ class Transforms
  public:
   Transform ch[3];
   int channels;
+
+  // Channels 2 and 3 cover half the width and height (4:2:0).
+  bool subsampled;
 };
 
 
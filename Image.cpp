@@ -278,14 +278,24 @@ void Image::ConvertToYCbCr(PixelValue& Y, PixelValue& Cb, PixelValue& Cr,
     }
 }
 
+// Pixels are bytes, keep converted colours in range instead of wrapping.
+static PixelValue Clamp(double value)
+{
+  if (value < 0)
+    return 0;
+  if (value > 255)
+    return 255;
+  return (PixelValue)value;
+}
+
 void Image::ConvertFromYCbCr(PixelValue& R, PixelValue& G, PixelValue& B,
                              PixelValue Y, PixelValue Cb, PixelValue Cr)
 {
   if (useYCbCr)
     {
-      R = (PixelValue)( Y                     + 1.402   *(Cr-128) );
-      G = (PixelValue)( Y - 0.34414 *(Cb-128) - 0.71414 *(Cr-128) );
-      B = (PixelValue)( Y + 1.772   *(Cb-128)                     );
+      R = Clamp( Y                     + 1.402   *(Cr-128) );
+      G = Clamp( Y - 0.34414 *(Cb-128) - 0.71414 *(Cr-128) );
+      B = Clamp( Y + 1.772   *(Cb-128)                     );
     }
   else
     {
@@ -16,8 +16,9 @@
 #ifndef IMAGE_H
 #define IMAGE_H
 
-//typedef unsigned char PixelValue;
-typedef unsigned int PixelValue;
+// Pixels are stored one byte each, the kernels widen them as needed.
+typedef unsigned char PixelValue;
+//typedef unsigned int PixelValue;
 
 class ImageData
 {
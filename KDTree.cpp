@@ -0,0 +1,176 @@
+/*
+ * Fractal Image Compression. Copyright 2004 Alex Kennberg.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+using namespace std;
+
+#include "KDTree.h"
+
+// Largest number of points stored in one leaf.
+#define LEAF_SIZE 8
+
+// Orders point indices by one coordinate, used to find the median.
+struct AxisLess
+{
+  const float* points;
+  int dim;
+  int axis;
+
+  bool operator()(int a, int b) const
+  {
+    return points[a * dim + axis] < points[b * dim + axis];
+  }
+};
+
+KDTree::KDTree()
+{
+  dim = 0;
+  count = 0;
+  points = NULL;
+  order = NULL;
+}
+
+KDTree::~KDTree()
+{
+  delete []points;
+  delete []order;
+}
+
+void KDTree::Build(const float* points, int count, int dim)
+{
+  delete []this->points;
+  delete []this->order;
+
+  this->dim = dim;
+  this->count = count;
+  this->points = new float[count * dim];
+  this->order = new int[count];
+  memcpy(this->points, points, count * dim * sizeof(float));
+  for (int i = 0; i < count; i++)
+    order[i] = i;
+
+  nodes.clear();
+  if (count > 0)
+    build(0, count);
+}
+
+int KDTree::GetCount()
+{
+  return count;
+}
+
+int KDTree::build(int begin, int end)
+{
+  int index = nodes.size();
+  Node node;
+
+  nodes.push_back(node);
+
+  if (end - begin <= LEAF_SIZE)
+    {
+      nodes[index].axis = -1;
+      nodes[index].left = begin;
+      nodes[index].right = end;
+      return index;
+    }
+
+  // Split along the dimension with the largest spread.
+  int axis = 0;
+  float spread = -1;
+  for (int d = 0; d < dim; d++)
+    {
+      float lo = points[order[begin] * dim + d];
+      float hi = lo;
+      for (int i = begin + 1; i < end; i++)
+        {
+          float v = points[order[i] * dim + d];
+          if (v < lo)
+            lo = v;
+          if (v > hi)
+            hi = v;
+        }
+      if (hi - lo > spread)
+        {
+          spread = hi - lo;
+          axis = d;
+        }
+    }
+
+  int mid = (begin + end) / 2;
+  AxisLess less = {points, dim, axis};
+  nth_element(order + begin, order + mid, order + end, less);
+
+  nodes[index].axis = axis;
+  nodes[index].split = points[order[mid] * dim + axis];
+  int left = build(begin, mid);
+  int right = build(mid, end);
+  nodes[index].left = left;
+  nodes[index].right = right;
+  return index;
+}
+
+void KDTree::Search(const float* query, int k, int maxChecks, Neighbors& neighbors)
+{
+  int checks = maxChecks > 0 ? maxChecks : count;
+
+  if (count > 0 && k > 0)
+    search(0, query, k, neighbors, checks);
+}
+
+void KDTree::search(int node, const float* query, int k, Neighbors& neighbors, int& checks)
+{
+  const Node& n = nodes[node];
+
+  if (n.axis < 0)
+    {
+      for (int i = n.left; i < n.right; i++)
+        {
+          const float* p = points + order[i] * dim;
+          float dist = 0;
+          for (int d = 0; d < dim; d++)
+            dist += (p[d] - query[d]) * (p[d] - query[d]);
+
+          if (neighbors.size() < k)
+            {
+              neighbors.push_back(make_pair(dist, order[i]));
+              push_heap(neighbors.begin(), neighbors.end());
+            }
+          else if (dist < neighbors.front().first)
+            {
+              pop_heap(neighbors.begin(), neighbors.end());
+              neighbors.back() = make_pair(dist, order[i]);
+              push_heap(neighbors.begin(), neighbors.end());
+            }
+          checks--;
+        }
+      return;
+    }
+
+  // Visit the side of the split holding the query first.
+  float diff = query[n.axis] - n.split;
+  int nearNode = diff < 0 ? n.left : n.right;
+  int farNode = diff < 0 ? n.right : n.left;
+
+  search(nearNode, query, k, neighbors, checks);
+  if (checks <= 0)
+    return;
+  if (neighbors.size() < k || diff * diff < neighbors.front().first)
+    search(farNode, query, k, neighbors, checks);
+}
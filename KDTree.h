@@ -0,0 +1,63 @@
+/*
+ * Fractal Image Compression. Copyright 2004 Alex Kennberg.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KDT_H
+#define KDT_H
+
+// (squared distance, point index) pairs kept as a max-heap by Search().
+typedef vector< pair<float, int> > Neighbors;
+
+class KDTree
+{
+ public:
+
+  KDTree();
+
+  ~KDTree();
+
+  // Build the tree over count points of dim floats each (copied).
+  void Build(const float* points, int count, int dim);
+
+  // Merge the k nearest points to query into neighbors. At most maxChecks
+  // points are compared (0 means no limit, i.e. exact search).
+  void Search(const float* query, int k, int maxChecks, Neighbors& neighbors);
+
+  int GetCount();
+
+ private:
+
+  struct Node
+  {
+    int axis;    // -1 for a leaf
+    float split;
+    int left;    // child nodes, or the point range of a leaf
+    int right;
+  };
+
+  int build(int begin, int end);
+
+  void search(int node, const float* query, int k, Neighbors& neighbors, int& checks);
+
+ private:
+
+  int dim;
+  int count;
+  float* points;
+  int* order;
+  vector<Node> nodes;
+};
+
+#endif // KDT_H
@@ -0,0 +1,56 @@
+/*
+ * Fractal Image Compression. Copyright 2004 Alex Kennberg.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstdio>
+#include <cmath>
+#include <string>
+using namespace std;
+
+#include "Image.h"
+#include "Kernels.h"
+
+namespace {
+#include "KernelsImpl.h"
+}
+
+Kernels kernelsScalar = KERNEL_TABLE("scalar", ScalarImpl);
+
+Kernels kernels = kernelsScalar;
+
+bool SelectKernels(string name)
+{
+  __builtin_cpu_init();
+
+  bool sse4 = __builtin_cpu_supports("sse4.1");
+  bool avx2 = sse4 && __builtin_cpu_supports("avx2");
+  bool avx512 = avx2 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+
+  if (name == "auto")
+    name = avx512 ? "avx512" : avx2 ? "avx2" : sse4 ? "sse4" : "scalar";
+
+  if (name == "scalar")
+    kernels = kernelsScalar;
+  else if (name == "sse4" && sse4)
+    kernels = kernelsSSE4;
+  else if (name == "avx2" && avx2)
+    kernels = kernelsAVX2;
+  else if (name == "avx512" && avx512)
+    kernels = kernelsAVX512;
+  else
+    return false;
+
+  return true;
+}
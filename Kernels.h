@@ -0,0 +1,74 @@
+/*
+ * Fractal Image Compression. Copyright 2004 Alex Kennberg.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KERNELS_H
+#define KERNELS_H
+
+/*
+  Pixel kernels used by the encoder and IFSTransform. There is one table
+  per instruction set, each built in its own file with the matching
+  compiler flags, and SelectKernels() picks one at startup. All pointers
+  point at the first pixel of a block; widths are row strides in pixels.
+*/
+struct Kernels
+{
+  const char* name;
+
+  // Sum of a size x size block.
+  int (*Sum)(const PixelValue* data, int width, int size);
+
+  // Sum of domain * range over a size x size block.
+  int (*CrossCorrelation)(const PixelValue* domain, int domainWidth,
+                          const PixelValue* range, int rangeWidth, int size);
+
+  // Correlation matrix of packed blocks of n pixels each:
+  // out[r * domainCount + d] = sum of range block r * domain block d.
+  void (*CrossCorrelations)(const PixelValue* ranges, int rangeCount,
+                            const PixelValue* domains, int domainCount,
+                            int n, int* out);
+
+  // Least squares scale of (domain - domainAvg) onto (range - rangeAvg).
+  double (*ScaleFactor)(const PixelValue* domain, int domainWidth, int domainAvg,
+                        const PixelValue* range, int rangeWidth, int rangeAvg,
+                        int size);
+
+  // Sum of squared differences between the scaled domain and the range.
+  // Stops early, returning the partial sum, once it is above limit.
+  int (*Error)(const PixelValue* domain, int domainWidth, int domainAvg,
+               const PixelValue* range, int rangeWidth, int rangeAvg,
+               int size, double scale, int limit);
+
+  // 2x2 average of a (size * 2) square region into a size x size block.
+  void (*DownSample)(const PixelValue* src, int srcWidth, PixelValue* dest, int size);
+
+  // dest[i] = clamp((int)(scale * src[i]) + offset), returns the sum of dest.
+  int (*ScaleRow)(const PixelValue* src, PixelValue* dest, int count,
+                  double scale, int offset);
+};
+
+extern Kernels kernelsScalar;
+extern Kernels kernelsSSE4;
+extern Kernels kernelsAVX2;
+extern Kernels kernelsAVX512;
+
+// The kernels in use.
+extern Kernels kernels;
+
+// Select kernels by name ("auto", "scalar", "sse4", "avx2", "avx512").
+// Returns false if the name is unknown or the CPU does not support it.
+bool SelectKernels(string name);
+
+#endif // KERNELS_H
@@ -0,0 +1,31 @@
+/*
+ * Fractal Image Compression. Copyright 2004 Alex Kennberg.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Built with -mavx2, see the Makefile.
+
+#include <cmath>
+#include <string>
+#include <immintrin.h>
+using namespace std;
+
+#include "Image.h"
+#include "Kernels.h"
+
+namespace {
+#include "KernelsImpl.h"
+}
+
+Kernels kernelsAVX2 = KERNEL_TABLE("avx2", Impl256);
@@ -0,0 +1,82 @@
+/*
+ * Fractal Image Compression. Copyright 2004 Alex Kennberg.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Built with -mavx512f -mavx512bw, see the Makefile.
+
+#include <cmath>
+#include <string>
+#include <immintrin.h>
+using namespace std;
+
+#include "Image.h"
+#include "Kernels.h"
+
+namespace {
+#include "KernelsImpl.h"
+
+// Sixteen 32-bit or thirty-two 16-bit pixels per vector (AVX-512).
+struct Vec512
+{
+  typedef __m512i I;
+  enum { W = 16, B = 32 };
+
+  static I zero() { return _mm512_setzero_si512(); }
+  static I set1(int v) { return _mm512_set1_epi32(v); }
+  static I load(const PixelValue* p) { return _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)p)); }
+  static void store(PixelValue* p, I v) { _mm_storeu_si128((__m128i*)p, _mm512_cvtusepi32_epi8(v)); }
+  static I loadWords(const PixelValue* p) { return _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)p)); }
+  static I madd(I a, I b) { return _mm512_madd_epi16(a, b); }
+
+  static I sad(const PixelValue* p)
+  {
+    return _mm512_zextsi256_si512(_mm256_sad_epu8(_mm256_loadu_si256((const __m256i*)p), _mm256_setzero_si256()));
+  }
+
+  static I add(I a, I b) { return _mm512_add_epi32(a, b); }
+  static I sub(I a, I b) { return _mm512_sub_epi32(a, b); }
+  static I mul(I a, I b) { return _mm512_mullo_epi32(a, b); }
+  static I min(I a, I b) { return _mm512_min_epi32(a, b); }
+  static I max(I a, I b) { return _mm512_max_epi32(a, b); }
+  static I quarter(I a) { return _mm512_srli_epi32(a, 2); }
+
+  static I pairSum(I a, I b)
+  {
+    const I even = _mm512_set_epi32(30, 28, 26, 24, 22, 20, 18, 16, 14, 12, 10, 8, 6, 4, 2, 0);
+    const I odd = _mm512_set_epi32(31, 29, 27, 25, 23, 21, 19, 17, 15, 13, 11, 9, 7, 5, 3, 1);
+    return _mm512_add_epi32(_mm512_permutex2var_epi32(a, even, b),
+                            _mm512_permutex2var_epi32(a, odd, b));
+  }
+
+  static I mulRound(I a, float s)
+  {
+    return _mm512_cvtps_epi32(_mm512_mul_ps(_mm512_set1_ps(s), _mm512_cvtepi32_ps(a)));
+  }
+
+  static I mulTrunc(I a, double s)
+  {
+    __m512d scale = _mm512_set1_pd(s);
+    __m256i lo = _mm512_cvttpd_epi32(_mm512_mul_pd(scale, _mm512_cvtepi32_pd(_mm512_castsi512_si256(a))));
+    __m256i hi = _mm512_cvttpd_epi32(_mm512_mul_pd(scale, _mm512_cvtepi32_pd(_mm512_extracti64x4_epi64(a, 1))));
+    return _mm512_inserti64x4(_mm512_castsi256_si512(lo), hi, 1);
+  }
+
+  static int hsum(I a) { return _mm512_reduce_add_epi32(a); }
+};
+
+typedef VectorImpl<Vec512, Impl256> Impl512;
+}
+
+Kernels kernelsAVX512 = KERNEL_TABLE("avx512", Impl512);
@@ -0,0 +1,473 @@
+/*
+ * Fractal Image Compression. Copyright 2004 Alex Kennberg.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+  Kernel bodies shared by the Kernels*.cpp files. They are written once
+  against a vector type V (see Vec128 below) and fall back to
+  the next narrower implementation for blocks narrower than one vector.
+
+  Pixels are bytes. V::load widens W of them to 32-bit lanes and V::store
+  packs them back. The sums and dot products instead widen B pixels to
+  16-bit lanes (or use psadbw) so twice as many pixels fit in a vector.
+
+  This file is included inside an anonymous namespace, so every
+  instruction set file gets its own private copy compiled with its own
+  flags. It must not include anything itself.
+*/
+
+// Rows between the early exit checks of Error: every row for small
+// blocks, every 4 rows from 16x16 up. The 32-bit lanes are also added
+// into a 64-bit total there, so 64x64 blocks cannot overflow them.
+static inline int ErrorRows(int size)
+{
+  return size >= 16 ? 4 : 1;
+}
+
+// Error sums are returned as int, large ones saturate.
+static inline int Saturate(long long sum)
+{
+  return sum > 0x7fffffff ? 0x7fffffff : (int)sum;
+}
+
+struct ScalarImpl
+{
+  static int Sum(const PixelValue* data, int width, int size)
+  {
+    int sum = 0;
+    for (int y = 0; y < size; y++, data += width)
+      for (int x = 0; x < size; x++)
+        sum += data[x];
+    return sum;
+  }
+
+  static int CrossCorrelation(const PixelValue* domain, int domainWidth,
+                              const PixelValue* range, int rangeWidth, int size)
+  {
+    int sum = 0;
+    for (int y = 0; y < size; y++, domain += domainWidth, range += rangeWidth)
+      for (int x = 0; x < size; x++)
+        sum += domain[x] * range[x];
+    return sum;
+  }
+
+  static void CrossCorrelations(const PixelValue* ranges, int rangeCount,
+                                const PixelValue* domains, int domainCount,
+                                int n, int* out)
+  {
+    for (int r = 0; r < rangeCount; r++, ranges += n)
+      for (int d = 0; d < domainCount; d++)
+        {
+          const PixelValue* domain = domains + d * n;
+          int sum = 0;
+          for (int k = 0; k < n; k++)
+            sum += ranges[k] * domain[k];
+          *out++ = sum;
+        }
+  }
+
+  static double ScaleFactor(const PixelValue* domain, int domainWidth, int domainAvg,
+                            const PixelValue* range, int rangeWidth, int rangeAvg,
+                            int size)
+  {
+    int top = 0;
+    int bottom = 0;
+    for (int y = 0; y < size; y++, domain += domainWidth, range += rangeWidth)
+      for (int x = 0; x < size; x++)
+        {
+          int d = (int)domain[x] - domainAvg;
+          top += d * ((int)range[x] - rangeAvg);
+          bottom += d * d;
+        }
+    if (bottom == 0)
+      return 0;
+    return ((double)top) / ((double)bottom);
+  }
+
+  static int Error(const PixelValue* domain, int domainWidth, int domainAvg,
+                   const PixelValue* range, int rangeWidth, int rangeAvg,
+                   int size, double scale, int limit)
+  {
+    // Same arithmetic as the vector versions: float product rounded to nearest
+    float s = (float)scale;
+    int rows = ErrorRows(size);
+    long long top = 0;
+    for (int y = 0; y < size; y++, domain += domainWidth, range += rangeWidth)
+      {
+        for (int x = 0; x < size; x++)
+          {
+            long long diff = lrintf(s * (float)((int)domain[x] - domainAvg))
+              - ((int)range[x] - rangeAvg);
+            top += diff * diff;
+          }
+        if ((y + 1) % rows == 0 && top > limit)
+          break;
+      }
+    return Saturate(top);
+  }
+
+  static void DownSample(const PixelValue* src, int srcWidth, PixelValue* dest, int size)
+  {
+    for (int y = 0; y < size; y++, src += srcWidth * 2, dest += size)
+      for (int x = 0; x < size; x++)
+        dest[x] = (src[x * 2] + src[x * 2 + 1] +
+                   src[srcWidth + x * 2] + src[srcWidth + x * 2 + 1]) / 4;
+  }
+
+  static int ScaleRow(const PixelValue* src, PixelValue* dest, int count,
+                      double scale, int offset)
+  {
+    int sum = 0;
+    for (int x = 0; x < count; x++)
+      {
+        int pixel = (int)(scale * src[x]) + offset;
+        if (pixel < 0)
+          pixel = 0;
+        if (pixel > 255)
+          pixel = 255;
+        dest[x] = pixel;
+        sum += pixel;
+      }
+    return sum;
+  }
+};
+
+template <class V, class Narrow>
+struct VectorImpl
+{
+  typedef typename V::I I;
+
+  static int Sum(const PixelValue* data, int width, int size)
+  {
+    if (size < V::B)
+      return Narrow::Sum(data, width, size);
+
+    I sum = V::zero();
+    for (int y = 0; y < size; y++, data += width)
+      for (int x = 0; x < size; x += V::B)
+        sum = V::add(sum, V::sad(data + x));
+    return V::hsum(sum);
+  }
+
+  static int CrossCorrelation(const PixelValue* domain, int domainWidth,
+                              const PixelValue* range, int rangeWidth, int size)
+  {
+    if (size < V::B)
+      return Narrow::CrossCorrelation(domain, domainWidth, range, rangeWidth, size);
+
+    I sum = V::zero();
+    for (int y = 0; y < size; y++, domain += domainWidth, range += rangeWidth)
+      for (int x = 0; x < size; x += V::B)
+        sum = V::add(sum, V::madd(V::loadWords(domain + x), V::loadWords(range + x)));
+    return V::hsum(sum);
+  }
+
+  static int Dot(const PixelValue* a, const PixelValue* b, int n)
+  {
+    I sum = V::zero();
+    for (int k = 0; k < n; k += V::B)
+      sum = V::add(sum, V::madd(V::loadWords(a + k), V::loadWords(b + k)));
+    return V::hsum(sum);
+  }
+
+  // Register blocked: each step loads two domain and four range vectors
+  // and feeds eight accumulators, so every load is used two or four times.
+  static void CrossCorrelations(const PixelValue* ranges, int rangeCount,
+                                const PixelValue* domains, int domainCount,
+                                int n, int* out)
+  {
+    if (n % V::B != 0)
+      return Narrow::CrossCorrelations(ranges, rangeCount, domains, domainCount, n, out);
+
+    int r = 0;
+    for (; r + 4 <= rangeCount; r += 4)
+      {
+        const PixelValue* r0 = ranges + r * n;
+        const PixelValue* r1 = r0 + n;
+        const PixelValue* r2 = r1 + n;
+        const PixelValue* r3 = r2 + n;
+        int* o = out + r * domainCount;
+
+        int d = 0;
+        for (; d + 2 <= domainCount; d += 2)
+          {
+            const PixelValue* d0 = domains + d * n;
+            const PixelValue* d1 = d0 + n;
+            I a00 = V::zero(), a01 = V::zero(), a10 = V::zero(), a11 = V::zero();
+            I a20 = V::zero(), a21 = V::zero(), a30 = V::zero(), a31 = V::zero();
+
+            for (int k = 0; k < n; k += V::B)
+              {
+                I x0 = V::loadWords(d0 + k);
+                I x1 = V::loadWords(d1 + k);
+                I y = V::loadWords(r0 + k);
+                a00 = V::add(a00, V::madd(y, x0));
+                a01 = V::add(a01, V::madd(y, x1));
+                y = V::loadWords(r1 + k);
+                a10 = V::add(a10, V::madd(y, x0));
+                a11 = V::add(a11, V::madd(y, x1));
+                y = V::loadWords(r2 + k);
+                a20 = V::add(a20, V::madd(y, x0));
+                a21 = V::add(a21, V::madd(y, x1));
+                y = V::loadWords(r3 + k);
+                a30 = V::add(a30, V::madd(y, x0));
+                a31 = V::add(a31, V::madd(y, x1));
+              }
+
+            o[d] = V::hsum(a00);
+            o[d + 1] = V::hsum(a01);
+            o[domainCount + d] = V::hsum(a10);
+            o[domainCount + d + 1] = V::hsum(a11);
+            o[domainCount * 2 + d] = V::hsum(a20);
+            o[domainCount * 2 + d + 1] = V::hsum(a21);
+            o[domainCount * 3 + d] = V::hsum(a30);
+            o[domainCount * 3 + d + 1] = V::hsum(a31);
+          }
+
+        for (; d < domainCount; d++)
+          for (int i = 0; i < 4; i++)
+            o[domainCount * i + d] = Dot(r0 + i * n, domains + d * n, n);
+      }
+
+    for (; r < rangeCount; r++)
+      for (int d = 0; d < domainCount; d++)
+        out[r * domainCount + d] = Dot(ranges + r * n, domains + d * n, n);
+  }
+
+  static double ScaleFactor(const PixelValue* domain, int domainWidth, int domainAvg,
+                            const PixelValue* range, int rangeWidth, int rangeAvg,
+                            int size)
+  {
+    if (size < V::W)
+      return Narrow::ScaleFactor(domain, domainWidth, domainAvg,
+                                 range, rangeWidth, rangeAvg, size);
+
+    I davg = V::set1(domainAvg);
+    I ravg = V::set1(rangeAvg);
+    I top = V::zero();
+    I bottom = V::zero();
+    for (int y = 0; y < size; y++, domain += domainWidth, range += rangeWidth)
+      for (int x = 0; x < size; x += V::W)
+        {
+          I d = V::sub(V::load(domain + x), davg);
+          I r = V::sub(V::load(range + x), ravg);
+          top = V::add(top, V::mul(d, r));
+          bottom = V::add(bottom, V::mul(d, d));
+        }
+
+    int b = V::hsum(bottom);
+    if (b == 0)
+      return 0;
+    return ((double)V::hsum(top)) / ((double)b);
+  }
+
+  static int Error(const PixelValue* domain, int domainWidth, int domainAvg,
+                   const PixelValue* range, int rangeWidth, int rangeAvg,
+                   int size, double scale, int limit)
+  {
+    if (size < V::W)
+      return Narrow::Error(domain, domainWidth, domainAvg,
+                           range, rangeWidth, rangeAvg, size, scale, limit);
+
+    I davg = V::set1(domainAvg);
+    I ravg = V::set1(rangeAvg);
+    I top = V::zero();
+    long long total = 0;
+    int rows = ErrorRows(size);
+    for (int y = 0; y < size; y++, domain += domainWidth, range += rangeWidth)
+      {
+        for (int x = 0; x < size; x += V::W)
+          {
+            I d = V::sub(V::load(domain + x), davg);
+            I diff = V::sub(V::mulRound(d, (float)scale), V::sub(V::load(range + x), ravg));
+            top = V::add(top, V::mul(diff, diff));
+          }
+        if ((y + 1) % rows == 0 || y + 1 == size)
+          {
+            total += V::hsum(top);
+            top = V::zero();
+            if (total > limit)
+              break;
+          }
+      }
+    return Saturate(total);
+  }
+
+  static void DownSample(const PixelValue* src, int srcWidth, PixelValue* dest, int size)
+  {
+    if (size < V::W)
+      return Narrow::DownSample(src, srcWidth, dest, size);
+
+    for (int y = 0; y < size; y++, src += srcWidth * 2, dest += size)
+      {
+        int x = 0;
+        for (; x + V::W <= size; x += V::W)
+          {
+            const PixelValue* top = src + x * 2;
+            const PixelValue* bottom = top + srcWidth;
+            I left = V::add(V::load(top), V::load(bottom));
+            I right = V::add(V::load(top + V::W), V::load(bottom + V::W));
+            V::store(dest + x, V::quarter(V::pairSum(left, right)));
+          }
+        for (; x < size; x++)
+          dest[x] = (src[x * 2] + src[x * 2 + 1] +
+                     src[srcWidth + x * 2] + src[srcWidth + x * 2 + 1]) / 4;
+      }
+  }
+
+  static int ScaleRow(const PixelValue* src, PixelValue* dest, int count,
+                      double scale, int offset)
+  {
+    I off = V::set1(offset);
+    I lo = V::set1(0);
+    I hi = V::set1(255);
+    I sum = V::zero();
+    int x = 0;
+
+    for (; x + V::W <= count; x += V::W)
+      {
+        I pixel = V::add(V::mulTrunc(V::load(src + x), scale), off);
+        pixel = V::min(V::max(pixel, lo), hi);
+        V::store(dest + x, pixel);
+        sum = V::add(sum, pixel);
+      }
+    return V::hsum(sum) + Narrow::ScaleRow(src + x, dest + x, count - x, scale, offset);
+  }
+};
+
+#ifdef __SSE4_1__
+
+// Four 32-bit or eight 16-bit pixels per vector (SSE4.1).
+struct Vec128
+{
+  typedef __m128i I;
+  enum { W = 4, B = 8 };
+
+  static I zero() { return _mm_setzero_si128(); }
+  static I set1(int v) { return _mm_set1_epi32(v); }
+  static I load(const PixelValue* p) { return _mm_cvtepu8_epi32(_mm_loadu_si32(p)); }
+
+  static void store(PixelValue* p, I v)
+  {
+    I words = _mm_packus_epi32(v, v);
+    _mm_storeu_si32(p, _mm_packus_epi16(words, words));
+  }
+
+  static I loadWords(const PixelValue* p) { return _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)p)); }
+  static I madd(I a, I b) { return _mm_madd_epi16(a, b); }
+  static I sad(const PixelValue* p) { return _mm_sad_epu8(_mm_loadl_epi64((const __m128i*)p), zero()); }
+  static I add(I a, I b) { return _mm_add_epi32(a, b); }
+  static I sub(I a, I b) { return _mm_sub_epi32(a, b); }
+  static I mul(I a, I b) { return _mm_mullo_epi32(a, b); }
+  static I min(I a, I b) { return _mm_min_epi32(a, b); }
+  static I max(I a, I b) { return _mm_max_epi32(a, b); }
+  static I quarter(I a) { return _mm_srli_epi32(a, 2); }
+
+  // Sums of neighbouring lanes: a0+a1, a2+a3, b0+b1, b2+b3
+  static I pairSum(I a, I b) { return _mm_hadd_epi32(a, b); }
+
+  static I mulRound(I a, float s)
+  {
+    return _mm_cvtps_epi32(_mm_mul_ps(_mm_set1_ps(s), _mm_cvtepi32_ps(a)));
+  }
+
+  // (int)(s * a) computed in double precision like the scalar code
+  static I mulTrunc(I a, double s)
+  {
+    __m128d scale = _mm_set1_pd(s);
+    __m128i lo = _mm_cvttpd_epi32(_mm_mul_pd(scale, _mm_cvtepi32_pd(a)));
+    __m128i hi = _mm_cvttpd_epi32(_mm_mul_pd(scale, _mm_cvtepi32_pd(_mm_srli_si128(a, 8))));
+    return _mm_unpacklo_epi64(lo, hi);
+  }
+
+  static int hsum(I a)
+  {
+    a = _mm_add_epi32(a, _mm_srli_si128(a, 8));
+    a = _mm_add_epi32(a, _mm_srli_si128(a, 4));
+    return _mm_cvtsi128_si32(a);
+  }
+};
+
+typedef VectorImpl<Vec128, ScalarImpl> Impl128;
+
+#endif // __SSE4_1__
+
+#ifdef __AVX2__
+
+// Eight 32-bit or sixteen 16-bit pixels per vector (AVX2).
+struct Vec256
+{
+  typedef __m256i I;
+  enum { W = 8, B = 16 };
+
+  static I zero() { return _mm256_setzero_si256(); }
+  static I set1(int v) { return _mm256_set1_epi32(v); }
+  static I load(const PixelValue* p) { return _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)p)); }
+
+  static void store(PixelValue* p, I v)
+  {
+    __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    _mm_storel_epi64((__m128i*)p, _mm_packus_epi16(words, words));
+  }
+
+  static I loadWords(const PixelValue* p) { return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)p)); }
+  static I madd(I a, I b) { return _mm256_madd_epi16(a, b); }
+
+  static I sad(const PixelValue* p)
+  {
+    return _mm256_zextsi128_si256(_mm_sad_epu8(_mm_loadu_si128((const __m128i*)p), _mm_setzero_si128()));
+  }
+
+  static I add(I a, I b) { return _mm256_add_epi32(a, b); }
+  static I sub(I a, I b) { return _mm256_sub_epi32(a, b); }
+  static I mul(I a, I b) { return _mm256_mullo_epi32(a, b); }
+  static I min(I a, I b) { return _mm256_min_epi32(a, b); }
+  static I max(I a, I b) { return _mm256_max_epi32(a, b); }
+  static I quarter(I a) { return _mm256_srli_epi32(a, 2); }
+
+  // hadd works per 128-bit half, put the halves back in order
+  static I pairSum(I a, I b)
+  {
+    return _mm256_permute4x64_epi64(_mm256_hadd_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+  }
+
+  static I mulRound(I a, float s)
+  {
+    return _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_set1_ps(s), _mm256_cvtepi32_ps(a)));
+  }
+
+  static I mulTrunc(I a, double s)
+  {
+    __m256d scale = _mm256_set1_pd(s);
+    __m128i lo = _mm256_cvttpd_epi32(_mm256_mul_pd(scale, _mm256_cvtepi32_pd(_mm256_castsi256_si128(a))));
+    __m128i hi = _mm256_cvttpd_epi32(_mm256_mul_pd(scale, _mm256_cvtepi32_pd(_mm256_extracti128_si256(a, 1))));
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+  }
+
+  static int hsum(I a)
+  {
+    return Vec128::hsum(_mm_add_epi32(_mm256_castsi256_si128(a), _mm256_extracti128_si256(a, 1)));
+  }
+};
+
+typedef VectorImpl<Vec256, Impl128> Impl256;
+
+#endif // __AVX2__
+
+// Fill a kernel table from one of the implementations above.
+#define KERNEL_TABLE(name, Impl) {                                      \
+    name, Impl::Sum, Impl::CrossCorrelation, Impl::CrossCorrelations,   \
+      Impl::ScaleFactor,                                                \
+      Impl::Error, Impl::DownSample, Impl::ScaleRow }
@@ -21,8 +21,10 @@
 #include <string>
 #include <time.h>
 #include <cstring>
+#include <cmath>
 #include <cstdint>
 #include <stdint.h>
+#include <algorithm>
 #include <omp.h>
 #include "counters.h"
 using namespace std;
@@ -30,7 +32,10 @@ using namespace std;
 #include "Image.h"
 #include "IFSTransform.h"
 #include "Encoder.h"
+#include "KDTree.h"
+#include "FFT.h"
 #include "QuadTreeEncoder.h"
+#include "Kernels.h"
 #include "count_ops.h"
 
 #define use_openmp true
@@ -40,15 +45,86 @@ using namespace std;
 extern int verb;
 extern bool useYCbCr;
 
-#define BUFFER_SIZE   (16)
 
 #if memoize
 #define IFS_EXECUTE_NEW
 #endif
+
+// Decode a class number (Lehmer code) into the quadrant order it stands for.
+static void classPermutation(int cls, int* order)
+{
+  int left[4] = {0, 1, 2, 3};
+  int n = 4;
+
+  for (int k = 0; k < 4; k++)
+    {
+      int fact = 1;
+      for (int i = 2; i < n; i++)
+        fact *= i;
+      int pick = cls / fact;
+      cls %= fact;
+      order[k] = left[pick];
+      for (int i = pick; i < n - 1; i++)
+        left[i] = left[i + 1];
+      n--;
+    }
+}
+
+// Number of quadrant pairs that two classes rank differently.
+static int classDistance(int a, int b)
+{
+  int orderA[4], orderB[4];
+  int posA[4], posB[4];
+  int dist = 0;
+
+  classPermutation(a, orderA);
+  classPermutation(b, orderB);
+  for (int k = 0; k < 4; k++)
+    {
+      posA[orderA[k]] = k;
+      posB[orderB[k]] = k;
+    }
+  for (int i = 0; i < 4; i++)
+    for (int j = i + 1; j < 4; j++)
+      if ((posA[i] < posA[j]) != (posB[i] < posB[j]))
+        dist++;
+  return dist;
+}
+
 QuadTreeEncoder::QuadTreeEncoder(int threshold, bool symmetry)
 {
   this->threshold = threshold;
   this->symmetry = symmetry;
+  symmetries = symmetry ? IFSTransform::SYM_MAX : 1;
+  maxBlockSize = 16;
+  topBlockSize = 16;
+  searchMode = SEARCH_FULL;
+  searchClasses = 1;
+  searchNeighbors = 16;
+  searchCandidates = 8;
+  searchTile = 0;
+  domainStep = 0;
+  searchRadius = 0;
+  searchFallback = 0;
+  flatTolerance = 0;
+  flatBlocks = 0;
+  cacheStep = 0;
+  cacheHits = cacheLookups = 0;
+  rdLambda = 0;
+  transformBudget = 0;
+  concurrentChannels = false;
+  reuseLuma = false;
+  chromaSubsampling = false;
+
+  // For every class list all classes from the closest to the furthest.
+  for (int cls = 0; cls < CLASS_COUNT; cls++)
+    {
+      int k = 0;
+      for (int dist = 0; dist <= 6; dist++)
+        for (int other = 0; other < CLASS_COUNT; other++)
+          if (classDistance(cls, other) == dist)
+            classOrder[cls][k++] = other;
+    }
 }
 
 QuadTreeEncoder::~QuadTreeEncoder()
@@ -69,234 +145,1568 @@ Transforms* QuadTreeEncoder::Encode(Image* source)
   img.height = source->GetHeight();
   img.channels = source->GetChannels();
   transforms->channels = img.channels;
+  transforms->subsampled = chromaSubsampling && useYCbCr && img.channels > 1;
+
+  // Every channel must hold whole domains of the top block size, two
+  // of them a side. Subsampled chroma planes are half as large.
+  int span = transforms->subsampled ? 4 : 2;
+  topBlockSize = 16;
+  while (topBlockSize * 2 <= min(maxBlockSize, MAX_BLOCK_SIZE))
+    topBlockSize *= 2;
+  while (topBlockSize > 16 &&
+         (img.width % (topBlockSize * span) != 0 || img.height % (topBlockSize * span) != 0))
+    topBlockSize /= 2;
+
+  int multiple = topBlockSize * span;
+  if (img.width % multiple != 0 || img.height % multiple != 0)
+    {
+      printf("Error: Image must have dimensions that are multiples of %d.\n", multiple);
+      exit(-1);
+    }
+  int levels = blockIndex(topBlockSize) + 1;
+
+  // Found by transforming blocks of x and y coordinates
+  for (int i = 0; i < levels; i++)
+    {
+      int blockSize = 2 << i;
+      int pixelCount = blockSize * blockSize;
+      vector<PixelValue> coords(2 * pixelCount);
+      vector<PixelValue> from(2 * pixelCount);
+      for (int p = 0; p < pixelCount; p++)
+        {
+          coords[p] = p % blockSize;
+          coords[pixelCount + p] = p / blockSize;
+        }
+
+      isometryMaps[i].resize(symmetries * pixelCount);
+      for (int sym = 0; sym < symmetries; sym++)
+        {
+          IFSTransform ifs(0, 0, 0, 0, blockSize, (IFSTransform::SYM)sym, 1.0, 0);
+          ifs.Execute(&coords[0], blockSize, &from[0], blockSize, true);
+          ifs.Execute(&coords[pixelCount], blockSize, &from[pixelCount], blockSize, true);
+          for (int p = 0; p < pixelCount; p++)
+            isometryMaps[i][sym * pixelCount + p] = from[pixelCount + p] * blockSize + from[p];
+        }
+    }
 
-  omp_set_num_threads(N_THREADS);
-  #ifndef IFS_EXECUTE_NEW
-    buffers = new PixelValue*[N_THREADS];
-    for (int i = 0; i < N_THREADS; i++){
-      buffers[i] = new PixelValue[BUFFER_SIZE * BUFFER_SIZE];
+  flatBlocks = 0;
+  cacheHits = cacheLookups = 0;
+  #ifdef IFS_EXECUTE_NEW
+    StartThreads();
+  #else
+    int threadCount = StartThreads();
+    buffers = new PixelValue*[threadCount];
+    for (int i = 0; i < threadCount; i++){
+      buffers[i] = new PixelValue[MAX_BLOCK_SIZE * MAX_BLOCK_SIZE];
     }
   #endif
+  fftWork.assign(omp_get_max_threads(), vector<double>());
+
+  Channel* channels = new Channel[img.channels];
+  Transform* lists[3];
+  for (int i = 0; i < img.channels; i++)
+    {
+      int shift = (i > 0 && transforms->subsampled) ? 1 : 0;
+      channels[i].width = img.width >> shift;
+      channels[i].height = img.height >> shift;
+      channels[i].guideShift = shift;
+      lists[i] = &transforms->ch[i];
+    }
+
+  // Channel 1 records its matches for the others to start from.
+  if (reuseLuma && img.channels > 1)
+    {
+      for (int i = 0; i < levels; i++)
+        channels[0].bestEntries[i].assign((img.width >> (i + 1)) * (img.height >> (i + 1)), -1);
+      for (int i = 1; i < img.channels; i++)
+        channels[i].guide = &channels[0];
+    }
+
+  // Record every block's match for merging down to the budget, or to
+  // build the quadtree from after a search by levels.
+  if (transformBudget > 0 || searchTile > 0)
+    {
+      for (int i = 0; i < img.channels; i++)
+        for (int j = 0; j < levels; j++)
+          {
+            int blocks = (channels[i].width >> (j + 1)) * (channels[i].height >> (j + 1));
+            channels[i].partition[j].assign(blocks, Match());
+            channels[i].searched[j].assign(blocks, 0);
+          }
+    }
+
+  if (concurrentChannels)
+    {
+      // All channels are kept in memory at once and share the threads.
+      // Channel 1 goes first when the others start from its matches.
+      int first = channels[img.channels - 1].guide != NULL ? 1 : 0;
+
+      for (int i = 0; i < img.channels; i++)
+        prepareChannel(channels[i], source, i + 1);
+      if (first)
+        searchChannels(channels, lists, first);
+      searchChannels(channels + first, lists + first, img.channels - first);
+      for (int i = 0; i < img.channels; i++)
+        releaseChannel(channels[i]);
+    }
+  else
+    {
+      for (int i = 0; i < img.channels; i++)
+        {
+          prepareChannel(channels[i], source, i + 1);
+          searchChannels(channels + i, lists + i, 1);
+          releaseChannel(channels[i]);
+        }
+    }
+
+  if (transformBudget > 0)
+    applyBudget(channels, transforms);
+
+  delete []channels;
+  vector< vector<double> >().swap(fftWork);
+
+  if (flatBlocks > 0)
+    printf("Flat blocks: %d\n", flatBlocks);
+  if (cacheLookups > 0)
+    printf("Range cache hits: %d of %d blocks (%.1f%%)\n", cacheHits, cacheLookups,
+           100.0 * cacheHits / cacheLookups);
+
+  return transforms;
+}
+
+QuadTreeEncoder::Channel::Channel()
+{
+  width = height = 0;
+  threshold = 0;
+  lambda = 0;
+  guide = NULL;
+  guideShift = 0;
+  imagedata = imagedata2 = NULL;
+  table = table2 = domainTable = domainTable2 = NULL;
+  for (int i = 0; i < LEVELS; i++)
+    {
+      averagePixels[i] = NULL;
+      domainSums[i] = domainSums2[i] = NULL;
+      for (int l = 0; l < LEVELS; l++)
+        {
+          pyramid[i][l].pixels = NULL;
+          pyramid[i][l].sums = pyramid[i][l].sums2 = NULL;
+        }
+    }
+}
+
+/*
+  Load one channel of the source and build everything the search reads:
+  the downsampled image, the summed-area tables and the domain pools.
+  Channels smaller than the source (4:2:0 chroma) are averaged down.
+*/
+void QuadTreeEncoder::prepareChannel(Channel& ch, Image* source, int channel)
+{
+  // Load image into a local copy
+  if (ch.width == img.width)
+    {
+      ch.imagedata = new PixelValue[ch.width * ch.height];
+      source->GetChannelData(channel, ch.imagedata, ch.width * ch.height);
+    }
+  else
+    {
+      PixelValue* full = new PixelValue[img.width * img.height];
+      source->GetChannelData(channel, full, img.width * img.height);
+      ch.imagedata = IFSTransform::DownSample(full, img.width, 0, 0, ch.width);
+      delete []full;
+    }
+
+  // Make second channel the downsampled version of the image.
+  ch.imagedata2 = IFSTransform::DownSample(ch.imagedata, ch.width, 0, 0, ch.width / 2);
+  calculateSummedAreaTable(ch);
+
+  // Spectrum of the downsampled image, zero padded to powers of two
+  if (searchMode == SEARCH_FFT)
+    {
+      int width = 1;
+      int height = 1;
+      while (width < ch.width / 2)
+        width <<= 1;
+      while (height < ch.height / 2)
+        height <<= 1;
+
+      ch.fft.Init(width, height);
+      ch.spectrum.assign(2 * width * height, 0);
+      for (int y = 0; y < ch.height / 2; y++)
+        for (int x = 0; x < ch.width / 2; x++)
+          ch.spectrum[y * width + x] = ch.imagedata2[y * (ch.width / 2) + x];
+      ch.fft.Forward(&ch.spectrum[0], &ch.spectrum[width * height], ch.height / 2, fftScratch(width * height));
+    }
+
+  // When using YCbCr we can reduce the quality of colour, because the eye
+  // is more sensitive to intensity which is channel 1.
+  ch.threshold = threshold;
+  if (channel >= 2 && useYCbCr)
+    ch.threshold *= 2;
+
+  // Chroma gets the same slack in the rate-distortion mode.
+  ch.lambda = rdLambda * ch.threshold / threshold;
+
+  if (cacheStep > 0)
+    ch.cache.resize(CACHE_BUCKETS);
 
   /*
-    The following code allocates space for the
-    data from IFS->execute().
+    Build up buffers for IFS->execute()
+    Block-sizes = 2, 4, 8, ... up to topBlockSize
   */
   #ifdef IFS_EXECUTE_NEW
-    int dim = (img.width * img.height) / 4;
-    executePixels[0] = new PixelValue[dim];
-    executePixels[1] = new PixelValue[dim];
-    executePixels[2] = new PixelValue[dim];
-    executePixels[3] = new PixelValue[dim];
-
-    averagePixels[0] = new PixelValue[(img.width / 4) * (img.height / 4)];
-    averagePixels[1] = new PixelValue[(img.width / 8) * (img.height / 8)];
-    averagePixels[2] = new PixelValue[(img.width / 16) * (img.height / 16)];
-    averagePixels[3] = new PixelValue[(img.width / 32) * (img.height / 32)];
+    for (int i = 0; i <= blockIndex(topBlockSize); i++)
+      {
+        int blockSize = 2 << i;
+        int columns, rows, step;
+        domainGrid(ch, blockSize, columns, rows, step);
+        int count = columns * rows;
+        ch.domainColumns[i] = columns;
+        ch.domainRows[i] = rows;
+        ch.domainSteps[i] = step;
+
+        // Average pixel, pixel sum and sum of squares of every domain
+        ch.averagePixels[i] = new PixelValue[count];
+        ch.domainSums[i] = new int[count];
+        ch.domainSums2[i] = new int[count];
+
+        executeIFS(ch, blockSize);
+        if (searchMode == SEARCH_PYRAMID)
+          {
+            buildPyramid(ch, blockSize);
+            if (blockSize == 4 || blockSize == 8)
+              ch.pyramidCandidates[i].assign((ch.width / blockSize) * (ch.height / blockSize) * max(searchCandidates, 1), -1);
+          }
+      }
   #endif
+}
 
-  for (int channel = 1; channel <= img.channels; channel++)
-    {
-        
-
-      // Load image into a local copy
-      img.imagedata = new PixelValue[img.width * img.height];
-      source->GetChannelData(channel, img.imagedata, img.width * img.height);
+void QuadTreeEncoder::releaseChannel(Channel& ch)
+{
+  vector< vector<CachedMatch> >().swap(ch.cache);
+  vector<CachedMatch>().swap(ch.pending);
+  vector<double>().swap(ch.spectrum);
 
-      if (img.width % 32 != 0 || img.height %32 != 0)
+  for (int i = 0; i < LEVELS; i++)
+    {
+      vector<int>().swap(ch.pyramidCandidates[i]);
+      delete []ch.averagePixels[i];
+      delete []ch.domainSums[i];
+      delete []ch.domainSums2[i];
+      ch.averagePixels[i] = NULL;
+      ch.domainSums[i] = ch.domainSums2[i] = NULL;
+
+      for (int l = 0; l < LEVELS; l++)
         {
-          printf("Error: Image must have dimensions that are multiples of 32.\n");
-          exit(-1);
+          Channel::Level& level = ch.pyramid[i][l];
+          delete []level.pixels;
+          delete []level.sums;
+          delete []level.sums2;
+          level.pixels = NULL;
+          level.sums = level.sums2 = NULL;
         }
+    }
 
+  delete []ch.table;
+  delete []ch.table2;
+  delete []ch.domainTable;
+  delete []ch.domainTable2;
+  ch.table = ch.table2 = ch.domainTable = ch.domainTable2 = NULL;
+
+  delete []ch.imagedata2;
+  delete []ch.imagedata;
+  ch.imagedata = ch.imagedata2 = NULL;
+}
+
+// Move the pending matches into the cache in scanline order, whatever
+// order the threads found them in. Only call it while no block of the
+// channel is searched.
+void QuadTreeEncoder::flushCache(Channel& ch)
+{
+  sort(ch.pending.begin(), ch.pending.end());
+  for (int i = 0; i < ch.pending.size(); i++)
+    {
+      vector<CachedMatch>& bucket = ch.cache[ch.pending[i].hash & (CACHE_BUCKETS - 1)];
+      if (bucket.size() >= CACHE_WAYS)
+        bucket.erase(bucket.begin());
+      bucket.push_back(ch.pending[i]);
+    }
+  ch.pending.clear();
+}
+
+/*
+  Go through all the range blocks of count channels as one parallel job.
+  Every block is a task and so is every quarter it gets split into, so
+  idle threads pick up the detailed parts of the image instead of
+  waiting for a whole row. With the range cache on, every row of top
+  blocks waits for the one before, which fills the cache. Each block writes its transforms into its own
+  slot, which are joined in scanline order afterwards.
+*/
+void QuadTreeEncoder::searchChannels(Channel* channels, Transform** transforms, int count)
+{
+  // Slots of channel c start at first[c]
+  vector<int> first(count + 1, 0);
+  for (int c = 0; c < count; c++)
+    first[c + 1] = first[c] + (channels[c].width / topBlockSize) * (channels[c].height / topBlockSize);
+  vector<Transform> blocks(first[count]);
+
+#ifdef IFS_EXECUTE_NEW
+  if (searchTile > 0)
+    {
+      for (int c = 0; c < count; c++)
+        searchTiles(channels[c], *transforms[c]);
+      printf("\n");
+      return;
+    }
+#endif
 
-      // Make second channel the downsampled version of the image.
-      //Get time before
-        img.imagedata2 = IFSTransform::DownSample(img.imagedata, img.width, 0, 0, img.width / 2);
-      // When using YCbCr we can reduce the quality of colour, because the eye
-      // is more sensitive to intensity which is channel 1.
-      if (channel >= 2 && useYCbCr)
-        threshold *= 2;
-
-      /*
-        Build up buffers for IFS->execute()
-        Block-sizes = 2, 4, 8, 16 (max -> BUFFER_SIZE)
-      */
-      #ifdef IFS_EXECUTE_NEW
-        executeIFS(2);
-        executeIFS(4);
-        executeIFS(8);
-        executeIFS(16);
-      #endif
-
-      // Go through all the range blocks
 #if use_openmp
-#pragma omp parallel for schedule(dynamic)
+#pragma omp parallel
+#pragma omp single
 #endif
-      for (int y = 0; y < img.height; y += BUFFER_SIZE)
+  for (int c = 0; c < count; c++)
+    {
+      Channel& ch = channels[c];
+      int columns = ch.width / topBlockSize;
+
+      for (int y = 0; y < ch.height; y += topBlockSize)
         {
-          for (int x = 0; x < img.width; x += BUFFER_SIZE)
+          for (int x = 0; x < ch.width; x += topBlockSize)
+            {
+              Transform& block = blocks[first[c] + (y / topBlockSize) * columns + x / topBlockSize];
+#if use_openmp
+#pragma omp task shared(ch, block)
+#endif
+              {
+                findMatchesFor(ch, block, x, y, topBlockSize);
+                printf(".");
+              }
+            }
+
+          if (cacheStep > 0)
             {
-              //printf("****Buffer Size: %d\n", BUFFER_SIZE);
-              findMatchesFor(transforms->ch[channel-1], x, y, BUFFER_SIZE);
-              printf(".");
+#if use_openmp
+#pragma omp taskwait
+#endif
+              flushCache(ch);
             }
-          printf("\n");
         }
+    }
+
+  for (int c = 0; c < count; c++)
+    for (int i = first[c]; i < first[c + 1]; i++)
+      transforms[c]->insert(transforms[c]->end(), blocks[i].begin(), blocks[i].end());
+  printf("\n");
+}
 
-       //elapsed = getTicks(cl) - current_time;
-       //printf("Number of Cycles required to take findBestMatch: %lu\n", elapsed);
+// Build the summed-area tables of a width x height image and its squares.
+// Both tables have an extra leading row and column of zeros.
+static void summedAreaTable(PixelValue* data, int width, int height,
+                            long long* sum, long long* sum2)
+{
+  int stride = width + 1;
 
-      // Bring the threshold back to original.
-      if (channel >= 2 && useYCbCr)
-        threshold /= 2;
+  for (int x = 0; x <= width; x++)
+    sum[x] = sum2[x] = 0;
 
-      delete []img.imagedata2;
-      img.imagedata2 = NULL;
-      delete []img.imagedata;
-      img.imagedata = NULL;
-      printf("\n");
+  for (int y = 0; y < height; y++)
+    {
+      long long row = 0;
+      long long row2 = 0;
+
+      sum[(y + 1) * stride] = sum2[(y + 1) * stride] = 0;
+      for (int x = 0; x < width; x++)
+        {
+          long long pixel = data[y * width + x];
+          row += pixel;
+          row2 += pixel * pixel;
+          sum[(y + 1) * stride + x + 1] = sum[y * stride + x + 1] + row;
+          sum2[(y + 1) * stride + x + 1] = sum2[y * stride + x + 1] + row2;
+        }
     }
+}
 
-  #ifdef IFS_EXECUTE_NEW
-    delete[] executePixels[0];
-    delete[] executePixels[1];
-    delete[] executePixels[2];
-    delete[] executePixels[3];
-  #endif
+// Sum over a size x size block, read from a table built by summedAreaTable().
+static long long areaSum(long long* table, int width, int x, int y, int size)
+{
+  int stride = width + 1;
 
-  return transforms;
+  return table[(y + size) * stride + x + size] - table[y * stride + x + size]
+    - table[(y + size) * stride + x] + table[y * stride + x];
 }
 
-void QuadTreeEncoder::executeIFS(int blockSize) {
-  int index = 0;
+/*
+  Summed-area tables of the current channel and of its downsampled copy,
+  so block means and variances anywhere in either image cost four lookups.
+*/
+void QuadTreeEncoder::calculateSummedAreaTable(Channel& ch)
+{
+  int size = (ch.width + 1) * (ch.height + 1);
+  int size2 = (ch.width / 2 + 1) * (ch.height / 2 + 1);
+
+  ch.table = new long long[size];
+  ch.table2 = new long long[size];
+  ch.domainTable = new long long[size2];
+  ch.domainTable2 = new long long[size2];
+
+  summedAreaTable(ch.imagedata, ch.width, ch.height, ch.table, ch.table2);
+  summedAreaTable(ch.imagedata2, ch.width / 2, ch.height / 2, ch.domainTable, ch.domainTable2);
+}
+
+int QuadTreeEncoder::rangeGetAveragePixel(Channel& ch, int x, int y, int blockSize)
+{
+  return (int)(areaSum(ch.table, ch.width, x, y, blockSize) / (blockSize * blockSize));
+}
+
+double QuadTreeEncoder::rangeGetVariance(Channel& ch, int x, int y, int blockSize)
+{
+  double n = blockSize * blockSize;
+  double mean = areaSum(ch.table, ch.width, x, y, blockSize) / n;
 
+  return areaSum(ch.table2, ch.width, x, y, blockSize) / n - mean * mean;
+}
+
+// Domain blocks are addressed by their position in the full size image, like
+// IFSTransform does, and read from the downsampled image.
+int QuadTreeEncoder::domainGetAveragePixel(Channel& ch, int x, int y, int blockSize)
+{
+  return (int)(areaSum(ch.domainTable, ch.width / 2, x / 2, y / 2, blockSize) / (blockSize * blockSize));
+}
+
+// Domains of blockSize pixels start every step pixels of imagedata2,
+// columns across and rows down.
+void QuadTreeEncoder::domainGrid(const Channel& ch, int blockSize, int& columns, int& rows, int& step)
+{
+  step = domainStep > 0 ? min(domainStep, blockSize) : blockSize;
+  columns = (ch.width / 2 - blockSize) / step + 1;
+  rows = (ch.height / 2 - blockSize) / step + 1;
+}
+
+int QuadTreeEncoder::blockIndex(int blockSize)
+{
   switch(blockSize){
+  case 2:
+    return 0;
   case 4:
-    index = 1;
-    break;
+    return 1;
   case 8:
-    index = 2;
-    break;
+    return 2;
   case 16:
-    index = 3;
-    break;
+    return 3;
+  case 32:
+    return 4;
+  case 64:
+    return 5;
   }
+  printf("Error: Unsupported block size %d.\n", blockSize);
+  exit(-1);
+}
 
-  PixelValue *ptr = executePixels[index];
-  int pixelCount  = blockSize * blockSize;
+/*
+  Classify a block by the brightness order of its four quadrants
+  (Fisher). The class is the rank of that order among all 4! orders.
+*/
+int QuadTreeEncoder::classify(PixelValue* data, int width, int x, int y, int size)
+{
+  int half = size / 2;
+  int sums[4] = {0, 0, 0, 0};
+  int order[4] = {0, 1, 2, 3};
 
-  PixelValue *avg = averagePixels[index];
+  for (int j = 0; j < size; j++)
+    for (int i = 0; i < size; i++)
+      sums[(j >= half) * 2 + (i >= half)] += data[(y + j) * width + x + i];
 
-  for (int y = 0; y < img.height; y += blockSize * 2) {
-    for (int x = 0; x < img.width; x += blockSize * 2) {
-        /* IFS */
-        IFSTransform::SYM symmetryEnum = (IFSTransform::SYM)symmetry;
-        IFSTransform *ifs = new IFSTransform(x, y, 0, 0, blockSize, symmetryEnum, 1.0, 0);
-        *avg = ifs->Execute(img.imagedata2, img.width / 2, ptr, blockSize, true);
+  // Brightest quadrant first, ties keep their natural order.
+  for (int i = 1; i < 4; i++)
+    for (int j = i; j > 0 && sums[order[j]] > sums[order[j - 1]]; j--)
+      {
+        int tmp = order[j];
+        order[j] = order[j - 1];
+        order[j - 1] = tmp;
+      }
+
+  int cls = 0;
+  for (int i = 0; i < 4; i++)
+    {
+      int smaller = 0;
+      for (int j = i + 1; j < 4; j++)
+        if (order[j] < order[i])
+          smaller++;
+      cls = cls * (4 - i) + smaller;
+    }
+  return cls;
+}
+
+/*
+  Feature vector of a block for the nearest neighbour search (Saupe):
+  the block is averaged down to at most FEATURE_SIZE x FEATURE_SIZE
+  cells, its mean removed and the result scaled to unit length.
+  Returns the number of components written to out.
+*/
+int QuadTreeEncoder::feature(PixelValue* data, int width, int x, int y, int size, float* out)
+{
+  int cells = size < FEATURE_SIZE ? size : FEATURE_SIZE;
+  int step = size / cells;
+  int dim = cells * cells;
+  float mean = 0;
+  float norm = 0;
+
+  for (int i = 0; i < dim; i++)
+    out[i] = 0;
+  for (int j = 0; j < size; j++)
+    for (int i = 0; i < size; i++)
+      out[(j / step) * cells + i / step] += data[(y + j) * width + x + i];
+
+  for (int i = 0; i < dim; i++)
+    mean += out[i];
+  mean /= dim;
+  for (int i = 0; i < dim; i++)
+    {
+      out[i] -= mean;
+      norm += out[i] * out[i];
+    }
+
+  // Flat blocks stay at the origin.
+  if (norm > 0)
+    {
+      norm = 1.0f / sqrtf(norm);
+      for (int i = 0; i < dim; i++)
+        out[i] *= norm;
+    }
+  return dim;
+}
 
-        /* Shift pointer */
-        ptr += pixelCount;
-        avg += 1;
+/*
+  Build the domain pool for one block size. With symmetry enabled the
+  pool holds every domain once per isometry, one copy of the whole grid
+  after the other, so entry e is domain (e % count) under symmetry
+  (e / count). The isometries share the same average pixel.
+
+  Domains are read in place from imagedata2, so the pool itself is just
+  their sums and averages; the entries are only transformed, one at a
+  time, for the searches that index them.
+*/
+void QuadTreeEncoder::executeIFS(Channel& ch, int blockSize) {
+  int index = blockIndex(blockSize);
+
+  int pixelCount  = blockSize * blockSize;
+  int columns, rows, step;
+  domainGrid(ch, blockSize, columns, rows, step);
+  int domainCount = columns * rows;
+  int entries = domainCount * symmetries;
+
+  for (int domain = 0; domain < domainCount; domain++)
+    {
+      int x = (domain % columns) * step;
+      int y = (domain / columns) * step;
+      ch.domainSums[index][domain] = (int)areaSum(ch.domainTable, ch.width / 2, x, y, blockSize);
+      ch.domainSums2[index][domain] = (int)areaSum(ch.domainTable2, ch.width / 2, x, y, blockSize);
+      ch.averagePixels[index][domain] = domainGetAveragePixel(ch, x * 2, y * 2, blockSize);
     }
+
+  if (searchMode != SEARCH_CLASSIFY && searchMode != SEARCH_KDTREE)
+    return;
+
+  int dim = blockSize < FEATURE_SIZE ? blockSize * blockSize : FEATURE_SIZE * FEATURE_SIZE;
+  float *features = NULL;
+  if (searchMode == SEARCH_KDTREE)
+    features = new float[entries * dim];
+
+  vector<int> classes;
+  if (searchMode == SEARCH_CLASSIFY)
+    classes.resize(entries);
+
+#if use_openmp
+#pragma omp parallel for schedule(static)
+#endif
+  for (int entry = 0; entry < entries; entry++) {
+    int domain = entry % domainCount;
+    PixelValue tile[MAX_BLOCK_SIZE * MAX_BLOCK_SIZE];
+    PixelValue ptr[MAX_BLOCK_SIZE * MAX_BLOCK_SIZE];
+    PixelValue* src = ch.imagedata2 + (domain / columns) * step * (ch.width / 2) + (domain % columns) * step;
+    for (int y = 0; y < blockSize; y++)
+      memcpy(tile + y * blockSize, src + y * (ch.width / 2), blockSize * sizeof(PixelValue));
+
+    const int* map = &isometryMaps[index][(entry / domainCount) * pixelCount];
+    for (int i = 0; i < pixelCount; i++)
+      ptr[i] = tile[map[i]];
+
+    if (searchMode == SEARCH_CLASSIFY)
+      classes[entry] = classify(ptr, blockSize, 0, 0, blockSize);
+    if (searchMode == SEARCH_KDTREE)
+      feature(ptr, blockSize, 0, 0, blockSize, features + entry * dim);
   }
+
+  // Class lists stay in pool order.
+  for (int cls = 0; cls < CLASS_COUNT; cls++)
+    ch.domainClasses[index][cls].clear();
+  for (int entry = 0; entry < (int)classes.size(); entry++)
+    ch.domainClasses[index][classes[entry]].push_back(entry);
+
+  if (searchMode == SEARCH_KDTREE)
+    {
+      ch.domainTrees[index].Build(features, entries, dim);
+      delete []features;
+    }
 }
 
 
+/*
+  Averaged down copies of the domain pool for one block size, for the
+  coarse to fine search: level l holds every entry at blockSize >> l
+  pixels a side, down to 4x4. 2x2 averages commute with the isometries,
+  so the entries keep the pool's order and level 1 comes straight from
+  the domains in imagedata2.
+*/
+void QuadTreeEncoder::buildPyramid(Channel& ch, int blockSize)
+{
+  int index = blockIndex(blockSize);
+  int columns, rows, step;
+  domainGrid(ch, blockSize, columns, rows, step);
+  int domainCount = columns * rows;
+  int entries = domainCount * symmetries;
+
+  for (int l = 1; l < index; l++)
+    {
+      Channel::Level& level = ch.pyramid[index][l];
+      int size = blockSize >> l;
+      int pixelCount = size * size;
+      PixelValue* finer = ch.pyramid[index][l - 1].pixels;
+
+      level.pixels = new PixelValue[entries * pixelCount];
+      level.sums = new int[domainCount];
+      level.sums2 = new int[domainCount];
+
+#if use_openmp
+#pragma omp parallel for schedule(static)
+#endif
+      for (int entry = 0; entry < entries; entry++)
+        {
+          PixelValue* ptr = level.pixels + entry * pixelCount;
+          if (l == 1)
+            {
+              // Average the domain down in place, then apply the isometry
+              int domain = entry % domainCount;
+              PixelValue down[MAX_BLOCK_SIZE * MAX_BLOCK_SIZE / 4];
+              kernels.DownSample(ch.imagedata2 + (domain / columns) * step * (ch.width / 2) + (domain % columns) * step,
+                                 ch.width / 2, down, size);
+              const int* map = &isometryMaps[index - 1][(entry / domainCount) * pixelCount];
+              for (int i = 0; i < pixelCount; i++)
+                ptr[i] = down[map[i]];
+            }
+          else
+            kernels.DownSample(finer + entry * pixelCount * 4, size * 2, ptr, size);
+
+          if (entry < domainCount)
+            {
+              int sum = 0;
+              int sum2 = 0;
+              for (int i = 0; i < pixelCount; i++)
+                {
+                  sum += ptr[i];
+                  sum2 += ptr[i] * ptr[i];
+                }
+              level.sums[entry] = sum;
+              level.sums2[entry] = sum2;
+            }
+        }
+    }
+}
+
 #ifdef IFS_EXECUTE_NEW
 // new version of QuadTreeEncoder::findMatchesFor
 
-void QuadTreeEncoder::findMatchesFor(Transform& transforms, int toX, int toY, int blockSize)
+void QuadTreeEncoder::testDomain(Channel& ch, int index, int entry, const Range& range, Match& best)
 {
+  int blockSize = range.size;
+  int columns = ch.domainColumns[index];
+  int step = ch.domainSteps[index];
+  int domainCount = columns * ch.domainRows[index];
+  int domain = entry % domainCount;
+
+  // The domain in place against the range block under the inverse isometry
+  int correlation = GetCrossCorrelation(ch.imagedata2, ch.width / 2,
+                                        (domain % columns) * step, (domain / columns) * step,
+                                        range.isometries + (entry / domainCount) * blockSize * blockSize,
+                                        blockSize, 0, 0, blockSize);
+  scoreDomain(ch, index, entry, range, correlation, best);
+}
 
-  int bestX = 0;
-  int bestY = 0;
-  int bestOffset = 0;
-  IFSTransform::SYM bestSymmetry = IFSTransform::SYM_NONE;
-  double bestScale = 0;
-  double bestError = 1e9;
+// Keep a pool entry as the best match if it is, given its correlation
+// with the range block.
+void QuadTreeEncoder::scoreDomain(Channel& ch, int index, int entry, const Range& range,
+                                  int correlation, Match& best)
+{
+  int blockSize = range.size;
+  int columns = ch.domainColumns[index];
+  int step = ch.domainSteps[index];
+  int domainCount = columns * ch.domainRows[index];
+  int domain = entry % domainCount;
+
+  // Get average pixel for the downsampled domain block
+  int domainAvg = ch.averagePixels[index][domain];
+
+  // Scale, offset and error follow from the block sums and one dot product
+  double scale;
+  double error = GetFit(blockSize, ch.domainSums[index][domain], ch.domainSums2[index][domain], domainAvg,
+                        range.sum, range.sum2, range.avg, correlation, scale);
+  int offset = (int)(range.avg - scale * (double)domainAvg);
+
+  if (error < best.error){
+    best.error = error;
+    best.entry = entry;
+    best.x = (domain % columns) * step * 2;
+    best.y = (domain / columns) * step * 2;
+    best.symmetry = (IFSTransform::SYM)(entry / domainCount);
+    best.scale = scale;
+    best.offset = offset;
+  }
+}
 
-  // Get average pixel for the range block
+// Fit error of a pool entry with the range block at pyramid level l, the
+// range block being pixels with the given sums there. Level 0 is the
+// pool itself.
+double QuadTreeEncoder::levelError(Channel& ch, int index, int l, int entry, const Range& range,
+                                   PixelValue* pixels, int sum, int sum2)
+{
+  int domainCount = ch.domainColumns[index] * ch.domainRows[index];
+  int domain = entry % domainCount;
+  double scale;
+
+  if (l == 0)
+    {
+      int columns = ch.domainColumns[index];
+      int step = ch.domainSteps[index];
+      int correlation = GetCrossCorrelation(ch.imagedata2, ch.width / 2,
+                                            (domain % columns) * step, (domain / columns) * step,
+                                            range.isometries + (entry / domainCount) * range.size * range.size,
+                                            range.size, 0, 0, range.size);
+      return GetFit(range.size, ch.domainSums[index][domain], ch.domainSums2[index][domain],
+                    ch.averagePixels[index][domain], range.sum, range.sum2, range.avg, correlation, scale);
+    }
+
+  Channel::Level& level = ch.pyramid[index][l];
+  int size = range.size >> l;
+  int pixelCount = size * size;
+  int correlation = GetCrossCorrelation(level.pixels + entry * pixelCount, size, 0, 0,
+                                        pixels, size, 0, 0, size);
+  return GetFit(size, level.sums[domain], level.sums2[domain], level.sums[domain] / pixelCount,
+                sum, sum2, sum / pixelCount, correlation, scale);
+}
+
+// Add an entry to the keep best (error, entry) pairs so far, sorted with
+// ties going to the lower entry as in the full search.
+static void keepCandidate(vector< pair<double, int> >& candidates, int keep, double error, int entry)
+{
+  pair<double, int> candidate(error, entry);
+  if (candidates.size() >= keep && !(candidate < candidates.back()))
+    return;
+
+  candidates.insert(upper_bound(candidates.begin(), candidates.end(), candidate), candidate);
+  if (candidates.size() > keep)
+    candidates.pop_back();
+}
 
-  int rangeAvg = GetAveragePixel(img.imagedata, img.width, toX, toY, blockSize);
+// The candidates and their neighbouring domains (same isometry), in pool order.
+static void neighbourEntries(const vector< pair<double, int> >& candidates, int columns, int rows,
+                             vector<int>& entries)
+{
+  int domainCount = columns * rows;
+  entries.clear();
+  for (int i = 0; i < candidates.size(); i++)
+    {
+      int entry = candidates[i].second;
+      int domain = entry % domainCount;
+      int sym = entry / domainCount;
+      int x = domain % columns;
+      int y = domain / columns;
+
+      for (int dy = -1; dy <= 1; dy++)
+        for (int dx = -1; dx <= 1; dx++)
+          if (x + dx >= 0 && x + dx < columns && y + dy >= 0 && y + dy < rows)
+            entries.push_back(sym * domainCount + (y + dy) * columns + x + dx);
+    }
+  sort(entries.begin(), entries.end());
+  entries.erase(unique(entries.begin(), entries.end()), entries.end());
+}
 
-    int index = 3;
-    switch(blockSize){
-    case 2:
-      index = 0;
-      break;
-    case 4:
-      index = 1;
-      break;
-    case 8:
-      index = 2;
-      break;
+/*
+  Coarse to fine search. Blocks of 8x8 and up score every entry on the
+  4x4 level of the pyramid and keep the searchCandidates best; each
+  finer level scores those and their neighbouring domains (same
+  isometry) and keeps the best again. Smaller blocks would have to
+  score the whole pool at full resolution, so they start from their
+  parent's survivors instead, moved to the four quarters of its domains
+  under the same isometry. The survivors and their neighbours are
+  tested at full resolution.
+*/
+void QuadTreeEncoder::searchPyramid(Channel& ch, int index, const Range& range, Match& best)
+{
+  int blockSize = range.size;
+  int columns, rows, step;
+  domainGrid(ch, blockSize, columns, rows, step);
+  int domainCount = columns * rows;
+  int coarsest = max(index - 1, 0);
+
+  // The range block averaged down alongside the pool
+  PixelValue levels[LEVELS][MAX_BLOCK_SIZE * MAX_BLOCK_SIZE / 4];
+  int sums[LEVELS] = { 0 };
+  int sums2[LEVELS] = { 0 };
+  for (int l = 1; l <= coarsest; l++)
+    {
+      int size = blockSize >> l;
+      if (l == 1)
+        kernels.DownSample(ch.imagedata + range.y * ch.width + range.x, ch.width, levels[l], size);
+      else
+        kernels.DownSample(levels[l - 1], size * 2, levels[l], size);
+
+      sums[l] = sums2[l] = 0;
+      for (int i = 0; i < size * size; i++)
+        {
+          sums[l] += levels[l][i];
+          sums2[l] += levels[l][i] * levels[l][i];
+        }
     }
 
-    PixelValue *buffer = executePixels[index];
-    int pixelCount = blockSize * blockSize;
+  vector< pair<double, int> > candidates;
+  vector<int> entries;
+  int keep = max(searchCandidates, 1);
 
-    PixelValue *avg = averagePixels[index];
+  // The parent's survivors, unless it was not searched (cache or guide hit)
+  const int* inherited = NULL;
+  if (index <= 1 && !ch.pyramidCandidates[index + 1].empty())
+    {
+      int parentSize = blockSize * 2;
+      int node = (range.y / parentSize) * (ch.width / parentSize) + range.x / parentSize;
+      inherited = &ch.pyramidCandidates[index + 1][node * keep];
+      if (inherited[0] < 0)
+        inherited = NULL;
+    }
 
-  // Go through all the downsampled domain blocks
-    for (int y = 0; y < img.height; y += blockSize * 2)
+  if (inherited != NULL)
     {
-      for (int x = 0; x < img.width; x += blockSize * 2)
+      // A parent domain's quarter starts blockSize pixels further on,
+      // rounded to this size's grid
+      int parentColumns = ch.domainColumns[index + 1];
+      int parentStep = ch.domainSteps[index + 1];
+      int parentCount = parentColumns * ch.domainRows[index + 1];
+
+      for (int k = 0; k < keep && inherited[k] >= 0; k++)
         {
-              // Get average pixel for the downsampled domain block
-              int domainAvg = *avg;
+          int domain = inherited[k] % parentCount;
+          int sym = inherited[k] / parentCount;
+          for (int q = 0; q < 4; q++)
+            {
+              int x = ((domain % parentColumns) * parentStep + (q & 1) * blockSize + step / 2) / step;
+              int y = ((domain / parentColumns) * parentStep + (q >> 1) * blockSize + step / 2) / step;
+              entries.push_back(sym * domainCount + min(y, rows - 1) * columns + min(x, columns - 1));
+            }
+        }
+      sort(entries.begin(), entries.end());
+      entries.erase(unique(entries.begin(), entries.end()), entries.end());
 
-              // Get scale and offset
-              double scale = GetScaleFactor(img.imagedata, img.width, toX, toY, domainAvg,
-                                            buffer, blockSize, 0, 0, rangeAvg, blockSize);
-              int offset = (int)(rangeAvg - scale * (double)domainAvg);
+      for (int i = 0; i < entries.size(); i++)
+        keepCandidate(candidates, keep, levelError(ch, index, 0, entries[i], range, NULL, 0, 0), entries[i]);
+    }
+  else if (coarsest == 0)
+    {
+      for (int entry = 0; entry < domainCount * symmetries; entry++)
+        keepCandidate(candidates, keep, levelError(ch, index, 0, entry, range, NULL, 0, 0), entry);
+    }
+  else
+    {
+      // The whole coarsest level, its correlations a chunk of entries at a time
+      Channel::Level& level = ch.pyramid[index][coarsest];
+      int size = blockSize >> coarsest;
+      int pixelCount = size * size;
+      int correlations[1024];
 
-              // Get error and compare to best error so far
-              double error = GetError(buffer, blockSize, 0, 0, domainAvg,
-                                      img.imagedata, img.width, toX, toY, rangeAvg, blockSize, scale);
+      for (int first = 0; first < domainCount * symmetries; first += 1024)
+        {
+          int count = min(1024, domainCount * symmetries - first);
+          kernels.CrossCorrelations(levels[coarsest], 1, level.pixels + first * pixelCount, count,
+                                    pixelCount, correlations);
+          for (int i = 0; i < count; i++)
+            {
+              int domain = (first + i) % domainCount;
+              double scale;
+              double error = GetFit(size, level.sums[domain], level.sums2[domain], level.sums[domain] / pixelCount,
+                                    sums[coarsest], sums2[coarsest], sums[coarsest] / pixelCount,
+                                    correlations[i], scale);
+              keepCandidate(candidates, keep, error, first + i);
+            }
+        }
+    }
 
-              if (error < bestError){
-                  bestError = error;
-                  bestX = x;
-                  bestY = y;
-                  bestSymmetry = (IFSTransform::SYM)0;
-                  bestScale = scale;
-                  bestOffset = offset;
+  for (int l = coarsest - 1; l >= 1; l--)
+    {
+      neighbourEntries(candidates, columns, rows, entries);
+      candidates.clear();
+      for (int i = 0; i < entries.size(); i++)
+        keepCandidate(candidates, keep,
+                      levelError(ch, index, l, entries[i], range, levels[l], sums[l], sums2[l]), entries[i]);
+    }
+
+  if (!ch.pyramidCandidates[index].empty())
+    {
+      int node = (range.y / blockSize) * (ch.width / blockSize) + range.x / blockSize;
+      for (int k = 0; k < keep; k++)
+        ch.pyramidCandidates[index][node * keep + k] = k < candidates.size() ? candidates[k].second : -1;
+    }
+
+  neighbourEntries(candidates, columns, rows, entries);
+  for (int i = 0; i < entries.size(); i++)
+    testDomain(ch, index, entries[i], range, best);
+}
+
+/*
+  Try a domain at every pixel of the downsampled image. The correlations
+  of the range block with all of them are one product with the image
+  spectrum per isometry, two isometries sharing a transform as its real
+  and imaginary part. Domain sums come from the summed-area tables, so
+  each fit is a few operations whatever the block size.
+*/
+void QuadTreeEncoder::searchFFT(Channel& ch, const Range& range, Match& best)
+{
+  int blockSize = range.size;
+  int pixelCount = blockSize * blockSize;
+  int width = ch.fft.width;
+  int height = ch.fft.height;
+  int columns = ch.width / 2 - blockSize + 1;
+  int rows = ch.height / 2 - blockSize + 1;
+
+  // This thread's transform of the range block, its product with the
+  // spectrum and the FFT's scratch, two planes each
+  int area = width * height;
+  double* data = fftScratch(area);
+  double* product = data + 2 * area;
+  double* scratch = data + 4 * area;
+  const double* spectrum = &ch.spectrum[0];
+  double norm = 1.0 / area;
+
+  for (int sym = 0; sym < symmetries; sym += 2)
+    {
+      // The range block under the inverse isometries, so that plain
+      // correlation with the image matches the transformed domains.
+      fill(data, data + 2 * area, 0.0);
+      for (int k = 0; k < 2 && sym + k < symmetries; k++)
+        for (int i = 0; i < pixelCount; i++)
+          data[k * area + (i / blockSize) * width + i % blockSize] =
+            range.isometries[(sym + k) * pixelCount + i];
+      ch.fft.Forward(data, data + area, blockSize, scratch);
+
+      // Correlating is multiplying by the spectrum at the opposite frequency
+      for (int v = 0; v < height; v++)
+        {
+          const double* ar = spectrum + v * width;
+          const double* ai = ar + area;
+          const double* br = data + ((height - v) & (height - 1)) * width;
+          const double* bi = br + area;
+          double* pr = product + v * width;
+          double* pi = pr + area;
+          for (int u = 0; u < width; u++)
+            {
+              int w = (width - u) & (width - 1);
+              pr[u] = ar[u] * br[w] - ai[u] * bi[w];
+              pi[u] = ar[u] * bi[w] + ai[u] * br[w];
+            }
+        }
+      ch.fft.Inverse(product, product + area, rows, scratch);
+
+      for (int k = 0; k < 2 && sym + k < symmetries; k++)
+        for (int y = 0; y < rows; y++)
+          for (int x = 0; x < columns; x++)
+            {
+              int correlation = (int)floor(product[k * area + y * width + x] * norm + 0.5);
+              int domainSum = (int)areaSum(ch.domainTable, ch.width / 2, x, y, blockSize);
+              int domainSum2 = (int)areaSum(ch.domainTable2, ch.width / 2, x, y, blockSize);
+              int domainAvg = domainSum / pixelCount;
+
+              double scale;
+              double error = GetFit(blockSize, domainSum, domainSum2, domainAvg,
+                                    range.sum, range.sum2, range.avg, correlation, scale);
+
+              // Not a pool entry, so not cached and no guide for others
+              if (error < best.error)
+                {
+                  best.error = error;
+                  best.entry = -1;
+                  best.x = x * 2;
+                  best.y = y * 2;
+                  best.symmetry = (IFSTransform::SYM)(sym + k);
+                  best.scale = scale;
+                  best.offset = (int)(range.avg - scale * (double)domainAvg);
                 }
-              buffer += pixelCount;
-              avg += 1;
+            }
+    }
+}
+
+// This thread's scratch for transforms of area values: six planes, grown
+// the first time a thread needs them.
+double* QuadTreeEncoder::fftScratch(int area)
+{
+  vector<double>& work = fftWork[omp_get_thread_num()];
+  if (work.size() < 6 * (size_t)area)
+    work.resize(6 * (size_t)area);
+  return &work[0];
+}
+
+/*
+  Everything about a range block short of the domain search: its sums,
+  the flat block test, the cache lookup and the guide's domain. Leaves
+  block.search set if the block still has to be searched.
+*/
+void QuadTreeEncoder::startBlock(Channel& ch, Block& block, int toX, int toY, int blockSize)
+{
+  Match& best = block.best;
+  best.entry = -1;
+  best.x = 0;
+  best.y = 0;
+  best.symmetry = IFSTransform::SYM_NONE;
+  best.scale = 0;
+  best.offset = 0;
+  best.error = 1e9;
+
+  // Get sums and average pixel for the range block
+  Range& range = block.range;
+  range.x = toX;
+  range.y = toY;
+  range.size = blockSize;
+  range.sum = (int)areaSum(ch.table, ch.width, toX, toY, blockSize);
+  range.sum2 = (int)areaSum(ch.table2, ch.width, toX, toY, blockSize);
+  range.avg = range.sum / (blockSize * blockSize);
+  range.isometries = NULL;
+
+  int index = block.index = blockIndex(blockSize);
+  int node = block.node = (toY / blockSize) * (ch.width / blockSize) + toX / blockSize;
+  block.flat = false;
+  block.search = true;
+
+  // A flat block is its average, whatever the domain. The variance is
+  // taken around the exact mean, the integer average would overstate it.
+  double mean = (double)range.sum / (blockSize * blockSize);
+  double variance = rangeGetVariance(ch, toX, toY, blockSize);
+  if (variance <= flatTolerance)
+    {
+#if use_openmp
+#pragma omp atomic
+#endif
+      flatBlocks++;
+      best.scale = 0;
+      best.offset = range.avg;
+      best.error = variance + (mean - range.avg) * (mean - range.avg);
+      block.flat = true;
+      block.search = block.cached = false;
+      return;
+    }
+
+  // Blocks that only differ in their average share the same match, as
+  // long as the search does not depend on where the block is.
+  block.cached = cacheStep > 0 && ch.guide == NULL && searchRadius == 0;
+  CachedMatch& lookup = block.lookup;
+  if (block.cached)
+    {
+      lookup.key.resize(blockSize * blockSize);
+      lookup.hash = 1469598103934665603ULL ^ blockSize;
+      for (int y = 0; y < blockSize; y++)
+        for (int x = 0; x < blockSize; x++)
+          {
+            int d = ch.imagedata[(toY + y) * ch.width + toX + x] - range.avg;
+            short q = d >= 0 ? d / cacheStep : -((cacheStep - 1 - d) / cacheStep);
+            lookup.key[y * blockSize + x] = q;
+            lookup.hash = (lookup.hash ^ (unsigned short)q) * 1099511628211ULL;
+          }
+
+      // No block adds to the cache while others are searched
+      const vector<CachedMatch>& bucket = ch.cache[lookup.hash & (CACHE_BUCKETS - 1)];
+      for (int i = 0; i < bucket.size() && block.search; i++)
+        if (bucket[i].hash == lookup.hash && bucket[i].key == lookup.key)
+          {
+            best = bucket[i].match;
+            block.search = false;
+          }
+
+#if use_openmp
+#pragma omp atomic
+#endif
+      cacheLookups++;
+      if (!block.search)
+        {
+#if use_openmp
+#pragma omp atomic
+#endif
+          cacheHits++;
+        }
+
+      // Keys only match up to cacheStep, so the error of the block that
+      // filled the cache says little about this one.
+      if (!block.search)
+        {
+          int entry = best.entry;
+          best.error = 1e9;
+          transformRange(ch, block);
+          testDomain(ch, index, entry, range, best);
         }
     }
 
-  if (blockSize > 2 && bestError >= threshold)
+  if (block.search)
+    transformRange(ch, block);
+
+  // Start from the domain the guide channel chose for this block and
+  // only search when that one is not good enough. A subsampled channel
+  // takes the domain of its grid closest to the guide's one of twice
+  // the block size.
+  int guideIndex = index + ch.guideShift;
+  if (ch.guide != NULL && guideIndex < LEVELS && !ch.guide->bestEntries[guideIndex].empty() &&
+      ch.guide->bestEntries[guideIndex][node] >= 0)
     {
-      // Recurse into the four corners of the current block.
-      blockSize /= 2;
-      findMatchesFor(transforms, toX, toY, blockSize);
-      findMatchesFor(transforms, toX + blockSize, toY, blockSize);
-      findMatchesFor(transforms, toX, toY + blockSize, blockSize);
-      findMatchesFor(transforms, toX + blockSize, toY + blockSize, blockSize);
+      int entry = ch.guide->bestEntries[guideIndex][node];
+      int guideColumns, guideRows, guideStep;
+      int columns, rows, step;
+      domainGrid(*ch.guide, blockSize << ch.guideShift, guideColumns, guideRows, guideStep);
+      domainGrid(ch, blockSize, columns, rows, step);
+
+      int domain = entry % (guideColumns * guideRows);
+      int x = min(((domain % guideColumns) * guideStep >> ch.guideShift) / step, columns - 1);
+      int y = min(((domain / guideColumns) * guideStep >> ch.guideShift) / step, rows - 1);
+      int sym = entry / (guideColumns * guideRows);
+
+      testDomain(ch, index, (sym * rows + y) * columns + x, range, best);
+      block.search = best.error >= ch.threshold;
+    }
+}
+
+/*
+  Copy the range block as each isometry sees it: copy s correlated with
+  a domain in place is the block correlated with the domain under s.
+*/
+void QuadTreeEncoder::transformRange(Channel& ch, Block& block)
+{
+  Range& range = block.range;
+  int size = range.size;
+  int pixelCount = size * size;
+
+  block.isometries.resize(symmetries * pixelCount);
+  for (int sym = 0; sym < symmetries; sym++)
+    {
+      const int* map = &isometryMaps[block.index][sym * pixelCount];
+      PixelValue* out = &block.isometries[sym * pixelCount];
+      for (int y = 0; y < size; y++)
+        {
+          const PixelValue* row = ch.imagedata + (range.y + y) * ch.width + range.x;
+          for (int x = 0; x < size; x++)
+            out[map[y * size + x]] = row[x];
+        }
+    }
+  range.isometries = &block.isometries[0];
+}
+
+// True if searchBlock() would test every entry of the block's pool.
+bool QuadTreeEncoder::scansPool(const Block& block)
+{
+  return searchMode != SEARCH_CLASSIFY && searchMode != SEARCH_KDTREE &&
+    searchMode != SEARCH_PYRAMID &&
+    !(searchMode == SEARCH_FFT && block.range.size >= FFT_MIN_BLOCK) && searchRadius == 0;
+}
+
+// Search the domains for a block that startBlock() left unmatched.
+void QuadTreeEncoder::searchBlock(Channel& ch, Block& block)
+{
+  const Range& range = block.range;
+  Match& best = block.best;
+  int toX = range.x;
+  int toY = range.y;
+  int blockSize = range.size;
+  int index = block.index;
+
+  if (searchMode == SEARCH_CLASSIFY)
+    {
+      // Only visit domains of the closest classes, but at least one domain.
+      int rangeClass = classify(ch.imagedata, ch.width, toX, toY, blockSize);
+      vector<int>* lists[CLASS_COUNT];
+      int visited = 0;
+      int tested = 0;
+
+      for (int k = 0; k < CLASS_COUNT && (k < searchClasses || !tested); k++)
+        if (!ch.domainClasses[index][classOrder[rangeClass][k]].empty())
+          {
+            lists[visited++] = &ch.domainClasses[index][classOrder[rangeClass][k]];
+            tested += lists[visited - 1]->size();
+          }
+
+      // Test in pool order so ties resolve as in the full search. Each
+      // class list already is, so one class needs no merging.
+      if (visited == 1)
+        {
+          for (int i = 0; i < lists[0]->size(); i++)
+            testDomain(ch, index, (*lists[0])[i], range, best);
+        }
+      else if (visited > 1)
+        {
+          vector<int> domains;
+          domains.reserve(tested);
+          for (int k = 0; k < visited; k++)
+            domains.insert(domains.end(), lists[k]->begin(), lists[k]->end());
+          sort(domains.begin(), domains.end());
+          for (int i = 0; i < domains.size(); i++)
+            testDomain(ch, index, domains[i], range, best);
+        }
+    }
+  else if (searchMode == SEARCH_KDTREE)
+    {
+      // Domains closest in shape to the range block, or to its negative
+      // since the scale factor may be negative. The query is approximate:
+      // at most 16 tree points are compared per wanted neighbour.
+      float query[FEATURE_SIZE * FEATURE_SIZE];
+      int dim = feature(ch.imagedata, ch.width, toX, toY, blockSize, query);
+      Neighbors neighbors;
+
+      ch.domainTrees[index].Search(query, searchNeighbors, searchNeighbors * 16, neighbors);
+      for (int i = 0; i < dim; i++)
+        query[i] = -query[i];
+      ch.domainTrees[index].Search(query, searchNeighbors, searchNeighbors * 16, neighbors);
+
+      // Test in pool order so ties resolve as in the full search.
+      vector<int> domains;
+      for (int i = 0; i < neighbors.size(); i++)
+        domains.push_back(neighbors[i].second);
+      sort(domains.begin(), domains.end());
+      domains.erase(unique(domains.begin(), domains.end()), domains.end());
+      for (int i = 0; i < domains.size(); i++)
+        testDomain(ch, index, domains[i], range, best);
+    }
+  else if (searchMode == SEARCH_PYRAMID)
+    {
+      searchPyramid(ch, index, range, best);
+    }
+  else if (searchMode == SEARCH_FFT && blockSize >= FFT_MIN_BLOCK)
+    {
+      searchFFT(ch, range, best);
+    }
+  else if (searchRadius > 0)
+    {
+      // Domains around the one covering the range block, and a few
+      // fallbacks from all over the image, tested in pool order.
+      int columns, rows, step;
+      domainGrid(ch, blockSize, columns, rows, step);
+      int domainCount = columns * rows;
+      int reach = searchRadius / (step * 2);
+      int x0 = max(min(toX / (step * 2), columns - 1) - reach, 0);
+      int x1 = min(toX / (step * 2) + reach, columns - 1);
+      int y0 = max(min(toY / (step * 2), rows - 1) - reach, 0);
+      int y1 = min(toY / (step * 2) + reach, rows - 1);
+      int fallback = min(searchFallback, domainCount);
+
+      vector<int> domains;
+      for (int sym = 0; sym < symmetries; sym++)
+        {
+          for (int y = y0; y <= y1; y++)
+            for (int x = x0; x <= x1; x++)
+              domains.push_back(sym * domainCount + y * columns + x);
+          for (int i = 0; i < fallback; i++)
+            domains.push_back(sym * domainCount + (int)((long long)i * domainCount / fallback));
+        }
+      sort(domains.begin(), domains.end());
+      domains.erase(unique(domains.begin(), domains.end()), domains.end());
+      for (int i = 0; i < domains.size(); i++)
+        testDomain(ch, index, domains[i], range, best);
     }
   else
     {
-      // Use this transformation
-      IFSTransform* new_transform = new IFSTransform(bestX, bestY,
-                                                     toX, toY,
-                                                     blockSize,
-                                                     bestSymmetry,
-                                                     bestScale,
-                                                     bestOffset);
-#pragma omp critical
+      // Go through all the downsampled domain blocks and their isometries
+      int columns, rows, step;
+      domainGrid(ch, blockSize, columns, rows, step);
+      int domainCount = columns * rows;
+      for (int entry = 0; entry < domainCount * symmetries; entry++)
+        testDomain(ch, index, entry, range, best);
+    }
+
+}
+
+// Remember the block's match for the cache, the other channels and the
+// rate-distortion partition.
+void QuadTreeEncoder::finishBlock(Channel& ch, Block& block)
 {
-      transforms.push_back(new_transform);
+  Match& best = block.best;
+
+  if (block.cached && block.search && best.entry >= 0)
+    {
+      block.lookup.match = best;
+      block.lookup.order = (block.range.y * ch.width + block.range.x) * LEVELS + LEVELS - 1 - block.index;
+#if use_openmp
+#pragma omp critical(rangeCache)
+#endif
+      ch.pending.push_back(block.lookup);
+    }
+
+  if (!ch.bestEntries[block.index].empty())
+    ch.bestEntries[block.index][block.node] = best.entry;
+  if (!ch.partition[block.index].empty())
+    {
+      ch.partition[block.index][block.node] = best;
+      ch.searched[block.index][block.node] = 1;
+    }
+
+  // The transformed copies are only needed for the search
+  vector<PixelValue>().swap(block.isometries);
+  block.range.isometries = NULL;
 }
+
+// Whether the block is worth splitting into its quadrants.
+bool QuadTreeEncoder::splitBlock(Channel& ch, const Block& block)
+{
+  // Squared error plus lambda for the transform. The quadrants cost at
+  // least 4 lambda, so they can only win when the error is above 3 lambda.
+  int blockSize = block.range.size;
+  double cost = block.best.error * blockSize * blockSize + ch.lambda;
+
+  if (blockSize <= 2 || block.flat)
+    return false;
+  return ch.lambda > 0 ? cost > 4 * ch.lambda : block.best.error >= ch.threshold;
+}
+
+double QuadTreeEncoder::findMatchesFor(Channel& ch, Transform& transforms, int toX, int toY, int blockSize)
+{
+  Block block;
+  startBlock(ch, block, toX, toY, blockSize);
+  if (block.search)
+    searchBlock(ch, block);
+  finishBlock(ch, block);
+
+  Match& best = block.best;
+  double cost = best.error * blockSize * blockSize + ch.lambda;
+
+  if (splitBlock(ch, block))
+    {
+      // Recurse into the four corners of the current block, as tasks
+      // that other threads can take over. Each corner collects its own
+      // transforms, appended in quadtree order once all are done.
+      Transform corners[4];
+      double costs[4];
+      int half = blockSize / 2;
+
+#if use_openmp
+#pragma omp task shared(ch, corners, costs)
+#endif
+      costs[0] = findMatchesFor(ch, corners[0], toX, toY, half);
+#if use_openmp
+#pragma omp task shared(ch, corners, costs)
+#endif
+      costs[1] = findMatchesFor(ch, corners[1], toX + half, toY, half);
+#if use_openmp
+#pragma omp task shared(ch, corners, costs)
+#endif
+      costs[2] = findMatchesFor(ch, corners[2], toX, toY + half, half);
+#if use_openmp
+#pragma omp task shared(ch, corners, costs)
+#endif
+      costs[3] = findMatchesFor(ch, corners[3], toX + half, toY + half, half);
+#if use_openmp
+#pragma omp taskwait
+#endif
+
+      // With a lambda keep the corners only if they are cheaper.
+      double splitCost = costs[0] + costs[1] + costs[2] + costs[3];
+      if (ch.lambda == 0 || splitCost < cost)
+        {
+          for (int i = 0; i < 4; i++)
+            transforms.insert(transforms.end(), corners[i].begin(), corners[i].end());
+          return splitCost;
+        }
+
+      for (int i = 0; i < 4; i++)
+        for (int j = 0; j < corners[i].size(); j++)
+          delete corners[i][j];
     }
+
+  // Use this transformation
+  IFSTransform* new_transform = new IFSTransform(best.x, best.y,
+                                                 toX, toY,
+                                                 blockSize,
+                                                 best.symmetry,
+                                                 best.scale,
+                                                 best.offset);
+  transforms.push_back(new_transform);
+  return cost;
+}
+
+/*
+  Search a channel a quadtree level at a time. Each level's blocks are
+  matched in tiles of searchTile blocks, one tile per thread. The blocks
+  that split queue their quadrants for the next level, and the
+  transforms are collected from ch.partition once all levels are done.
+*/
+void QuadTreeEncoder::searchTiles(Channel& ch, Transform& transforms)
+{
+  // (x, y) of the blocks to match at the current level
+  vector<int> positions;
+  for (int y = 0; y < ch.height; y += topBlockSize)
+    for (int x = 0; x < ch.width; x += topBlockSize)
+      {
+        positions.push_back(x);
+        positions.push_back(y);
+      }
+
+  for (int blockSize = topBlockSize; blockSize >= 2 && !positions.empty(); blockSize /= 2)
+    {
+      int count = positions.size() / 2;
+      vector<Block> blocks(count);
+
+      // The quadrants follow their parents, so each row of top blocks
+      // is a run of positions. With the range cache on, the rows are
+      // matched one after the other and fill the cache in between.
+      for (int start = 0; start < count; )
+        {
+          int end = count;
+          if (cacheStep > 0)
+            for (end = start + 1; end < count; end++)
+              if (positions[end * 2 + 1] / topBlockSize != positions[start * 2 + 1] / topBlockSize)
+                break;
+
+          int tiles = (end - start + searchTile - 1) / searchTile;
+#if use_openmp
+#pragma omp parallel for schedule(dynamic)
+#endif
+          for (int t = 0; t < tiles; t++)
+            {
+              int first = start + t * searchTile;
+              matchTile(ch, &blocks[first], &positions[first * 2], min(searchTile, end - first), blockSize);
+            }
+
+          if (cacheStep > 0)
+            flushCache(ch);
+          start = end;
+        }
+
+      vector<int> next;
+      int half = blockSize / 2;
+      for (int i = 0; i < count; i++)
+        if (splitBlock(ch, blocks[i]))
+          {
+            int x = positions[i * 2];
+            int y = positions[i * 2 + 1];
+            int corners[8] = { x, y, x + half, y, x, y + half, x + half, y + half };
+            next.insert(next.end(), corners, corners + 8);
+          }
+      positions.swap(next);
+      printf(".");
+    }
+
+  for (int y = 0; y < ch.height; y += topBlockSize)
+    for (int x = 0; x < ch.width; x += topBlockSize)
+      collectPartition(ch, transforms, x, y, topBlockSize);
+}
+
+/*
+  Match count blocks of one size. Those that need the whole pool scan
+  it together, a chunk of SEARCH_CHUNK_BYTES at a time, so each chunk
+  is read from memory once per tile instead of once per block. For each
+  chunk the correlations of all those blocks with all its entries come
+  from one matrix product (kernels.CrossCorrelations) per isometry of
+  the packed range blocks, under that isometry, and the chunk's domains
+  packed once from imagedata2. Each block keeps the best entry of every
+  isometry apart and merges them in pool order at the end, so ties
+  resolve as if it had seen the entries in pool order.
+*/
+void QuadTreeEncoder::matchTile(Channel& ch, Block* blocks, const int* positions, int count, int blockSize)
+{
+  int index = blockIndex(blockSize);
+  int pixelCount = blockSize * blockSize;
+  int columns, rows, step;
+  domainGrid(ch, blockSize, columns, rows, step);
+  int domainCount = columns * rows;
+
+  // Chunks also bound the correlation matrix to 1024 columns
+  int chunk = min(max(SEARCH_CHUNK_BYTES / (int)(pixelCount * sizeof(PixelValue)), 1), 1024);
+  vector<Block*> scanning;
+
+  for (int i = 0; i < count; i++)
+    {
+      startBlock(ch, blocks[i], positions[i * 2], positions[i * 2 + 1], blockSize);
+      if (blocks[i].search && scansPool(blocks[i]))
+        scanning.push_back(&blocks[i]);
+      else if (blocks[i].search)
+        searchBlock(ch, blocks[i]);
+    }
+
+  // The blocks under the first isometry, then under the second and so on
+  int rangeCount = scanning.size();
+  vector<PixelValue> ranges(symmetries * rangeCount * pixelCount);
+  for (int sym = 0; sym < symmetries; sym++)
+    for (int i = 0; i < rangeCount; i++)
+      memcpy(&ranges[(sym * rangeCount + i) * pixelCount],
+             scanning[i]->range.isometries + sym * pixelCount, pixelCount * sizeof(PixelValue));
+
+  Match unset = Match();
+  unset.entry = -1;
+  unset.error = 1e9;
+  vector<Match> symBest(rangeCount * symmetries, unset);
+
+  vector<PixelValue> domains(chunk * pixelCount);
+  vector<int> correlations(rangeCount * chunk);
+  for (int start = 0, end; start < domainCount && rangeCount > 0; start = end)
+    {
+      end = min(start + chunk, domainCount);
+
+      for (int domain = start; domain < end; domain++)
+        {
+          PixelValue* src = ch.imagedata2 + (domain / columns) * step * (ch.width / 2) + (domain % columns) * step;
+          for (int y = 0; y < blockSize; y++)
+            memcpy(&domains[(domain - start) * pixelCount + y * blockSize],
+                   src + y * (ch.width / 2), blockSize * sizeof(PixelValue));
+        }
+
+      for (int sym = 0; sym < symmetries; sym++)
+        {
+          kernels.CrossCorrelations(&ranges[sym * rangeCount * pixelCount], rangeCount,
+                                    &domains[0], end - start, pixelCount, &correlations[0]);
+
+          for (int i = 0; i < rangeCount; i++)
+            for (int domain = start; domain < end; domain++)
+              scoreDomain(ch, index, sym * domainCount + domain, scanning[i]->range,
+                          correlations[i * (end - start) + domain - start], symBest[i * symmetries + sym]);
+        }
+    }
+
+  for (int i = 0; i < rangeCount; i++)
+    for (int sym = 0; sym < symmetries; sym++)
+      if (symBest[i * symmetries + sym].error < scanning[i]->best.error)
+        scanning[i]->best = symBest[i * symmetries + sym];
+
+  for (int i = 0; i < count; i++)
+    finishBlock(ch, blocks[i]);
+}
+
+// Append the transforms of a searched block's partition in quadtree order.
+void QuadTreeEncoder::collectPartition(Channel& ch, Transform& transforms, int x, int y, int size)
+{
+  // With a lambda keep the cheapest partition, like findMatchesFor
+  if (ch.lambda > 0)
+    {
+      int count = 0;
+      prunePartition(ch, x, y, size, ch.lambda, count, &transforms);
+      return;
+    }
+
+  int half = size / 2;
+  if (size > 2 && ch.searched[blockIndex(half)][(y / half) * (ch.width / half) + x / half])
+    {
+      collectPartition(ch, transforms, x, y, half);
+      collectPartition(ch, transforms, x + half, y, half);
+      collectPartition(ch, transforms, x, y + half, half);
+      collectPartition(ch, transforms, x + half, y + half, half);
+      return;
+    }
+
+  Match& best = ch.partition[blockIndex(size)][(y / size) * (ch.width / size) + x / size];
+  transforms.push_back(new IFSTransform(best.x, best.y, x, y, size,
+                                        best.symmetry, best.scale, best.offset));
 }
 
 #else
   // old version of QuadTreeEncoder::findMatchesFor
 
-void QuadTreeEncoder::findMatchesFor(Transform& transforms, int toX, int toY, int blockSize)
+double QuadTreeEncoder::findMatchesFor(Channel& ch, Transform& transforms, int toX, int toY, int blockSize)
 {
 
   int bestX = 0;
@@ -311,12 +1721,14 @@ void QuadTreeEncoder::findMatchesFor(Transform& transforms, int toX, int toY, in
 
   // Get average pixel for the range block
 
-  int rangeAvg = GetAveragePixel(img.imagedata, img.width, toX, toY, blockSize);
+  int rangeAvg = rangeGetAveragePixel(ch, toX, toY, blockSize);
 
   // Go through all the downsampled domain blocks
-    for (int y = 0; y < img.height; y += blockSize * 2)
+  int columns, rows, step;
+  domainGrid(ch, blockSize, columns, rows, step);
+    for (int y = 0; y < rows * step * 2; y += step * 2)
     {
-      for (int x = 0; x < img.width; x += blockSize * 2)
+      for (int x = 0; x < columns * step * 2; x += step * 2)
         {
           INC_OP(3);
           PixelValue* buffer = buffers[omp_get_thread_num()];
@@ -327,18 +1739,19 @@ void QuadTreeEncoder::findMatchesFor(Transform& transforms, int toX, int toY, in
 
               IFSTransform* ifs = new IFSTransform(x, y, 0, 0, blockSize, symmetryEnum, 1.0, 0);
               INC_OP(1);
-              ifs->Execute(img.imagedata2, img.width / 2, buffer, blockSize, true);
+              ifs->Execute(ch.imagedata2, ch.width / 2, buffer, blockSize, true);
               int domainAvg = GetAveragePixel(buffer, blockSize, 0, 0, blockSize);
 
 
               // Get scale and offset
-              double scale = GetScaleFactor(img.imagedata, img.width, toX, toY, domainAvg,
+              double scale = GetScaleFactor(ch.imagedata, ch.width, toX, toY, domainAvg,
                                             buffer, blockSize, 0, 0, rangeAvg, blockSize);
               int offset = (int)(rangeAvg - scale * (double)domainAvg);
 
               // Get error and compare to best error so far
               double error = GetError(buffer, blockSize, 0, 0, domainAvg,
-                                      img.imagedata, img.width, toX, toY, rangeAvg, blockSize, scale);
+                                      ch.imagedata, ch.width, toX, toY, rangeAvg, blockSize, scale,
+                                      bestError);
 
               INC_OP(1);
 
@@ -360,14 +1773,14 @@ void QuadTreeEncoder::findMatchesFor(Transform& transforms, int toX, int toY, in
     }
 
 
-  if (blockSize > 2 && bestError >= threshold)
+  if (blockSize > 2 && bestError >= ch.threshold)
     {
       // Recurse into the four corners of the current block.
       blockSize /= 2;
-      findMatchesFor(transforms, toX, toY, blockSize);
-      findMatchesFor(transforms, toX + blockSize, toY, blockSize);
-      findMatchesFor(transforms, toX, toY + blockSize, blockSize);
-      findMatchesFor(transforms, toX + blockSize, toY + blockSize, blockSize);
+      findMatchesFor(ch, transforms, toX, toY, blockSize);
+      findMatchesFor(ch, transforms, toX + blockSize, toY, blockSize);
+      findMatchesFor(ch, transforms, toX, toY + blockSize, blockSize);
+      findMatchesFor(ch, transforms, toX + blockSize, toY + blockSize, blockSize);
     }
   else
     {
@@ -380,10 +1793,7 @@ void QuadTreeEncoder::findMatchesFor(Transform& transforms, int toX, int toY, in
                                                      bestScale,
                                                      bestOffset
                                                      );
-#pragma omp critical
-      {
-              transforms.push_back(new_transform);
-      }
+      transforms.push_back(new_transform);
       INC_OP(1);
       if (verb >= 1)
         {
@@ -395,5 +1805,115 @@ void QuadTreeEncoder::findMatchesFor(Transform& transforms, int toX, int toY, in
           printf("best scale=%lf\n", bestScale);
         }
     }
+
+  // The old search has no rate-distortion mode
+  return bestError * blockSize * blockSize;
 }
 #endif //end old version of QuadTreeEncoder::findMatchesFor
+
+/*
+  Cost of the cheapest partition of a block for this lambda, from the
+  matches the search recorded in ch.partition. Quadrants are only
+  considered where they were searched. Adds the number of transforms
+  to count and, if out is given, appends them in quadtree order.
+*/
+double QuadTreeEncoder::prunePartition(Channel& ch, int x, int y, int size,
+                                       double lambda, int& count, Transform* out)
+{
+  Match& best = ch.partition[blockIndex(size)][(y / size) * (ch.width / size) + x / size];
+  double cost = best.error * size * size + lambda;
+  int half = size / 2;
+
+  if (size > 2 && ch.searched[blockIndex(half)][(y / half) * (ch.width / half) + x / half])
+    {
+      int splitCount = 0;
+      double splitCost = prunePartition(ch, x, y, half, lambda, splitCount, NULL)
+        + prunePartition(ch, x + half, y, half, lambda, splitCount, NULL)
+        + prunePartition(ch, x, y + half, half, lambda, splitCount, NULL)
+        + prunePartition(ch, x + half, y + half, half, lambda, splitCount, NULL);
+
+      if (splitCost < cost)
+        {
+          count += splitCount;
+          if (out != NULL)
+            {
+              int ignored = 0;
+              prunePartition(ch, x, y, half, lambda, ignored, out);
+              prunePartition(ch, x + half, y, half, lambda, ignored, out);
+              prunePartition(ch, x, y + half, half, lambda, ignored, out);
+              prunePartition(ch, x + half, y + half, half, lambda, ignored, out);
+            }
+          return splitCost;
+        }
+    }
+
+  count++;
+  if (out != NULL)
+    out->push_back(new IFSTransform(best.x, best.y, x, y, size,
+                                    best.symmetry, best.scale, best.offset));
+  return cost;
+}
+
+/*
+  Raise lambda until the recorded partitions fit in transformBudget
+  transforms, then rebuild the transform lists from them. Merges
+  bottom-up only, blocks are not searched again.
+*/
+void QuadTreeEncoder::applyBudget(Channel* channels, Transforms* transforms)
+{
+  int count = 0;
+  for (int i = 0; i < img.channels; i++)
+    count += transforms->ch[i].size();
+  if (count <= transformBudget)
+    return;
+
+  // Bisect lambda between one that is over the budget and one that is
+  // not (or merges everything it can).
+  double low = rdLambda;
+  double high = max(rdLambda * 2, 1.0);
+  int blocks = 0;
+  for (int i = 0; i < img.channels; i++)
+    blocks += (channels[i].width / topBlockSize) * (channels[i].height / topBlockSize);
+
+  while (partitionCount(channels, high) > transformBudget && high < 1e12)
+    high *= 2;
+  for (int i = 0; i < 50 && high - low > high * 1e-6; i++)
+    {
+      double middle = (low + high) / 2;
+      if (partitionCount(channels, middle) > transformBudget)
+        low = middle;
+      else
+        high = middle;
+    }
+
+  if (partitionCount(channels, high) > transformBudget)
+    printf("Warning: %d transforms, the budget is below the %d largest blocks.\n",
+           partitionCount(channels, high), blocks);
+
+  for (int i = 0; i < img.channels; i++)
+    {
+      Channel& ch = channels[i];
+      Transform& list = transforms->ch[i];
+      for (int j = 0; j < list.size(); j++)
+        delete list[j];
+      list.clear();
+
+      for (int y = 0; y < ch.height; y += topBlockSize)
+        for (int x = 0; x < ch.width; x += topBlockSize)
+          prunePartition(ch, x, y, topBlockSize, high * ch.threshold / threshold, count, &list);
+    }
+}
+
+// Transforms in all channels' partitions for this lambda.
+int QuadTreeEncoder::partitionCount(Channel* channels, double lambda)
+{
+  int count = 0;
+  for (int i = 0; i < img.channels; i++)
+    {
+      Channel& ch = channels[i];
+      for (int y = 0; y < ch.height; y += topBlockSize)
+        for (int x = 0; x < ch.width; x += topBlockSize)
+          prunePartition(ch, x, y, topBlockSize, lambda * ch.threshold / threshold, count, NULL);
+    }
+  return count;
+}
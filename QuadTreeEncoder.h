@@ -17,8 +17,45 @@
 #ifndef QTE_H
 #define QTE_H
 
+// Number of quadrant brightness orderings (4!) used to classify blocks.
+#define CLASS_COUNT 24
+
+// Block feature vectors are averaged down to at most this many cells a side.
+#define FEATURE_SIZE 4
+
+// Range blocks of level i are 2 << i pixels a side, up to MAX_BLOCK_SIZE.
+#define MAX_BLOCK_SIZE 64
+#define LEVELS 6
+
+// Bytes of a domain pool scanned by a whole tile of range blocks before
+// moving on, about the size of L2.
+#define SEARCH_CHUNK_BYTES (256 * 1024)
+
+// Buckets of the per-channel range block cache (a power of two), and
+// matches kept per bucket before the oldest is replaced.
+#define CACHE_BUCKETS 65536
+#define CACHE_WAYS 8
+
+// SEARCH_FFT tries a domain at every pixel of the downsampled image for
+// range blocks of at least FFT_MIN_BLOCK pixels. Smaller blocks search
+// the pool (every pixel too with domainStep 1), their direct search
+// being cheaper than the transforms.
+#define FFT_MIN_BLOCK 32
+
 class QuadTreeEncoder : public Encoder
 {
+ public:
+
+  enum SEARCH
+  {
+    SEARCH_FULL = 0,
+    SEARCH_CLASSIFY,
+    SEARCH_KDTREE,
+    SEARCH_PYRAMID,
+    SEARCH_FFT,
+    SEARCH_MAX
+  };
+
  public:
 
   QuadTreeEncoder(int threshold = 100, bool symmetry = true);
@@ -29,19 +66,248 @@ class QuadTreeEncoder : public Encoder
 
   PixelValue** buffers;
 
+  // Largest range block, 16, 32 or 64 pixels (other sizes round down to
+  // one of these). Encode starts from the largest size up to this one
+  // that the image dimensions allow.
+  int maxBlockSize;
+
+  // Domain search strategy and, for SEARCH_CLASSIFY, how many of the
+  // closest classes to visit (CLASS_COUNT is the full search).
+  SEARCH searchMode;
+  int searchClasses;
+
+  // Domains fully evaluated per range block with SEARCH_KDTREE.
+  int searchNeighbors;
+
+  // Candidates kept at each coarser level with SEARCH_PYRAMID.
+  int searchCandidates;
+
+  // Domains start every domainStep pixels of the downsampled image, at
+  // most every block size (0: every block size, so they do not overlap).
+  int domainStep;
+
+  // Limit SEARCH_FULL to domains within searchRadius pixels of the range
+  // block (0 searches the whole image), plus searchFallback domains
+  // spread evenly over the image.
+  int searchRadius;
+  int searchFallback;
+
+  // Range blocks with a pixel variance up to flatTolerance are stored as
+  // their average (scale 0) without a search; flatBlocks counts them.
+  double flatTolerance;
+  int flatBlocks;
+
+  // Reuse the match of an earlier range block with the same content
+  // after removing the average and dividing by cacheStep (0 turns the
+  // cache off, 1 only matches identical blocks). The cached domain is
+  // refit to the block, scale, offset and error, without a search.
+  // Only blocks of earlier rows of top blocks are reused, so the matches
+  // do not depend on the order the threads get to them.
+  // cacheHits of cacheLookups blocks were found in the cache.
+  int cacheStep;
+  int cacheHits;
+  int cacheLookups;
+
+  // Split a block only when its quadrants cost less squared error plus
+  // rdLambda per transform than the block itself (0 uses the threshold).
+  // transformBudget (0: none) caps the transforms of all channels by
+  // raising lambda and merging quadrants bottom-up after the search.
+  double rdLambda;
+  int transformBudget;
+
+  // Search the quadtree a level at a time, matching tiles of this many
+  // range blocks against one cache-sized chunk of the domain pool after
+  // the other (0 searches block by block, depth first).
+  int searchTile;
+
+  // Prepare every channel first and search all of them in one parallel
+  // job, instead of one channel after the other.
+  bool concurrentChannels;
+
+  // Try the domain channel 1 chose for the same block before searching
+  // the other channels.
+  bool reuseLuma;
+
+  // In YCbCr mode encode Cb and Cr at half the width and height (4:2:0).
+  bool chromaSubsampling;
+
  protected:
-  void findMatchesFor(Transform& transforms, int toX, int toY, int blockSize);
-  void executeIFS(int blockSize);
-  void calculateSummedAreaTable();
-  int domainGetAveragePixel(int x, int y, int blockSize);
+  struct Match
+  {
+    int entry;
+    int x;
+    int y;
+    IFSTransform::SYM symmetry;
+    double scale;
+    int offset;
+    double error;
+  };
+
+  struct CachedMatch
+  {
+    unsigned long long hash;
+    vector<short> key;
+    Match match;
+    int order; // position of the range block in scanline order
+
+    bool operator<(const CachedMatch& other) const { return order < other.order; }
+  };
+
+  struct Range
+  {
+    int x;
+    int y;
+    int size;
+    int sum;
+    int sum2;
+    int avg;
+
+    // The block as each isometry sees it, see transformRange().
+    PixelValue* isometries;
+  };
+
+  // Search state of one range block, see startBlock().
+  struct Block
+  {
+    Range range;
+    vector<PixelValue> isometries;
+    Match best;
+    int index;
+    int node;
+    bool flat;
+    bool search;
+    bool cached;
+    CachedMatch lookup;
+  };
+
+  // Everything the search needs to know about one channel.
+  struct Channel
+  {
+    Channel();
+
+    int width;
+    int height;
+    int threshold;
+    double lambda;
+
+    // The channel and its downsampled copy
+    PixelValue *imagedata;
+    PixelValue *imagedata2;
+
+    // Summed-area tables (sum and sum of squares) of imagedata and of
+    // the downsampled imagedata2, see calculateSummedAreaTable().
+    long long *table;
+    long long *table2;
+    long long *domainTable;
+    long long *domainTable2;
+
+    // Average pixel, sums and indexes of the domains, which are read in
+    // place from imagedata2, see executeIFS().
+    PixelValue *averagePixels[LEVELS];
+    int *domainSums[LEVELS];
+    int *domainSums2[LEVELS];
+    vector<int> domainClasses[LEVELS][CLASS_COUNT];
+
+    // domainGrid() of every block size, for the inner search loops
+    int domainColumns[LEVELS];
+    int domainRows[LEVELS];
+    int domainSteps[LEVELS];
+    KDTree domainTrees[LEVELS];
+
+    // Pool i averaged down l times (l = 1..i-1) for SEARCH_PYRAMID, with
+    // the pixel sums and sums of squares of every domain.
+    struct Level
+    {
+      PixelValue *pixels;
+      int *sums;
+      int *sums2;
+    };
+    Level pyramid[LEVELS][LEVELS];
+
+    // searchCandidates pool entries that survived the coarse to fine
+    // search of every 4x4 and 8x8 block (-1 if fewer), where its
+    // quadrants start instead of scanning the pool, see searchPyramid().
+    vector<int> pyramidCandidates[LEVELS];
+
+    // Pool entry that matched best for every block this channel searched
+    // (-1 if it did not), and the channel whose choices are tried first.
+    // A block of size index i matches the guide's block of index
+    // i + guideShift, which is 1 for subsampled channels.
+    vector<int> bestEntries[LEVELS];
+    Channel *guide;
+    int guideShift;
+
+    // Matches found so far by range block content, see findMatchesFor().
+    // Matches of the current row of top blocks wait in pending until the
+    // row is done, see flushCache().
+    vector< vector<CachedMatch> > cache;
+    vector<CachedMatch> pending;
+
+    // Best match of every block searched, laid out like bestEntries,
+    // and whether each block was searched, for transformBudget.
+    vector<Match> partition[LEVELS];
+    vector<char> searched[LEVELS];
+
+    // Spectrum of imagedata2 for SEARCH_FFT (real parts, then imaginary
+    // parts), see searchFFT().
+    FFT fft;
+    vector<double> spectrum;
+  };
+
+ protected:
+  void prepareChannel(Channel& ch, Image* source, int channel);
+  void releaseChannel(Channel& ch);
+  void flushCache(Channel& ch);
+  void searchChannels(Channel* channels, Transform** transforms, int count);
+  double findMatchesFor(Channel& ch, Transform& transforms, int toX, int toY, int blockSize);
+  void startBlock(Channel& ch, Block& block, int toX, int toY, int blockSize);
+  bool scansPool(const Block& block);
+  void searchBlock(Channel& ch, Block& block);
+  void finishBlock(Channel& ch, Block& block);
+  bool splitBlock(Channel& ch, const Block& block);
+  void searchTiles(Channel& ch, Transform& transforms);
+  void matchTile(Channel& ch, Block* blocks, const int* positions, int count, int blockSize);
+  void collectPartition(Channel& ch, Transform& transforms, int x, int y, int size);
+  double prunePartition(Channel& ch, int x, int y, int size, double lambda, int& count, Transform* out);
+  int partitionCount(Channel* channels, double lambda);
+  void applyBudget(Channel* channels, Transforms* transforms);
+  void testDomain(Channel& ch, int index, int entry, const Range& range, Match& best);
+  void scoreDomain(Channel& ch, int index, int entry, const Range& range, int correlation, Match& best);
+  void executeIFS(Channel& ch, int blockSize);
+  void buildPyramid(Channel& ch, int blockSize);
+  double levelError(Channel& ch, int index, int l, int entry, const Range& range,
+                    PixelValue* pixels, int sum, int sum2);
+  void searchPyramid(Channel& ch, int index, const Range& range, Match& best);
+  void searchFFT(Channel& ch, const Range& range, Match& best);
+  double* fftScratch(int area);
+  void transformRange(Channel& ch, Block& block);
+  void domainGrid(const Channel& ch, int blockSize, int& columns, int& rows, int& step);
+  void calculateSummedAreaTable(Channel& ch);
+  int rangeGetAveragePixel(Channel& ch, int x, int y, int blockSize);
+  double rangeGetVariance(Channel& ch, int x, int y, int blockSize);
+  int domainGetAveragePixel(Channel& ch, int x, int y, int blockSize);
+
+  static int blockIndex(int blockSize);
+  static int classify(PixelValue* data, int width, int x, int y, int size);
+  static int feature(PixelValue* data, int width, int x, int y, int size, float* out);
 
  protected:
   int threshold;
   bool symmetry;
+  int symmetries;
+
+  // Range block size the quadtree starts from in this Encode
+  int topBlockSize;
+
+  // For every isometry and pixel of a block of each size, the pixel of
+  // the domain block that IFSTransform maps onto it.
+  vector<int> isometryMaps[LEVELS];
+
+  // Each thread's room for searchFFT()'s transforms, shared by all
+  // channels and only allocated by threads that run the FFT search.
+  vector< vector<double> > fftWork;
 
-  PixelValue *executePixels[4];
-  PixelValue *averagePixels[4];
-  PixelValue *table;
+  int classOrder[CLASS_COUNT][CLASS_COUNT];
 };
 
 #endif // QTE_H
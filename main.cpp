@@ -19,6 +19,7 @@
 #include <iostream>
 #include <cstdio>
 #include <cstdlib>
+#include <cmath>
 #include <vector>
 #include <string>
 //#include <windows.h>
@@ -27,8 +28,11 @@ using namespace std;
 #include "Image.h"
 #include "IFSTransform.h"
 #include "Encoder.h"
+#include "KDTree.h"
+#include "FFT.h"
 #include "QuadTreeEncoder.h"
 #include "Decoder.h"
+#include "Kernels.h"
 #include "counters.h"
 #include "count_ops.h"
 
@@ -44,7 +48,54 @@ bool useYCbCr = true;
 
 void printUsage(char *exe);
 
-void Convert(Encoder* enc, Image* source, int maxphases, int output)
+// PSNR of the decoded image against the source, over all channels.
+double GetPSNR(Image* source, Decoder* dec)
+{
+  int size = source->GetWidth() * source->GetHeight();
+  Image* decoded = dec->GetNewImage("", 0);
+  PixelValue* a = new PixelValue[size];
+  PixelValue* b = new PixelValue[size];
+  double error = 0;
+
+  for (int ch = 1; ch <= source->GetChannels(); ch++)
+    {
+      source->GetChannelData(ch, a, size);
+      decoded->GetChannelData(ch, b, size);
+      for (int i = 0; i < size; i++)
+        error += (double)(a[i] - b[i]) * (a[i] - b[i]);
+    }
+
+  delete []a;
+  delete []b;
+  delete decoded;
+
+  double mse = error / ((double)size * source->GetChannels());
+  return mse > 0 ? 10 * log10(255.0 * 255.0 / mse) : 99.0;
+}
+
+// Encode and decode the loaded source again with the full search, and
+// print what the encoder's search radius cost against radiusPSNR, the
+// PSNR Convert() got with it.
+void ReportSearchLoss(QuadTreeEncoder* enc, Image* source, int phases, double radiusPSNR)
+{
+  int radius = enc->searchRadius;
+
+  enc->searchRadius = 0;
+  Transforms* transforms = enc->Encode(source);
+  Decoder* dec = new Decoder(source->GetWidth(), source->GetHeight());
+  for (int phase = 1; phase <= phases; phase++)
+    dec->Decode(transforms);
+  double psnr = GetPSNR(source, dec);
+  delete dec;
+  delete transforms;
+  enc->searchRadius = radius;
+
+  printf("Search radius %d: PSNR %.3f dB, full search %.3f dB (%.3f dB lost)\n",
+         radius, radiusPSNR, psnr, psnr - radiusPSNR);
+}
+
+// Encode and decode the source, and return the PSNR of the final image.
+double Convert(Encoder* enc, Image* source, int maxphases, int output)
 {
   printf("Loading image...\n");
   source->Load();
@@ -129,6 +180,7 @@ void Convert(Encoder* enc, Image* source, int maxphases, int output)
       delete producer;
     }
 
+  double psnr = GetPSNR(source, dec);
   delete dec;
   delete transforms;
 
@@ -152,6 +204,7 @@ void Convert(Encoder* enc, Image* source, int maxphases, int output)
   cout<<"getAveragePixel: "<< op_counter[getaveragepixel_i] <<'\n';
 #endif
   printf("Finished.\n");
+  return psnr;
 }
 
 
@@ -162,6 +215,26 @@ int main(int argc, char **argv)
   string fileName;
   int threshhold = 100;
   bool symmetry = false;
+  int maxBlockSize = 16;
+  int searchMode = QuadTreeEncoder::SEARCH_FULL;
+  int searchClasses = 1;
+  int searchNeighbors = 16;
+  int searchCandidates = 8;
+  int domainStep = 0;
+  int searchTile = 0;
+  int searchRadius = 0;
+  int searchFallback = 0;
+  double flatTolerance = 0;
+  int cacheStep = 0;
+  double rdLambda = 0;
+  int transformBudget = 0;
+  bool reportSearchLoss = false;
+  string kernelName("auto");
+  int threads = 0;
+  bool pinThreads = false;
+  bool concurrentChannels = false;
+  bool reuseLuma = false;
+  bool chromaSubsampling = false;
   int phases = 5;
   int output = 1;
   bool usage = true;
@@ -179,6 +252,46 @@ int main(int argc, char **argv)
         phases = atoi(argv[i + 1]);
       else if (param == "-o" && i + 1 < argc)
         output = atoi(argv[i + 1]);
+      else if (param == "-z" && i + 1 < argc)
+        maxBlockSize = atoi(argv[i + 1]);
+      else if (param == "-s" && i + 1 < argc)
+        searchMode = atoi(argv[i + 1]);
+      else if (param == "-c" && i + 1 < argc)
+        searchClasses = atoi(argv[i + 1]);
+      else if (param == "-n" && i + 1 < argc)
+        searchNeighbors = atoi(argv[i + 1]);
+      else if (param == "-e" && i + 1 < argc)
+        searchCandidates = atoi(argv[i + 1]);
+      else if (param == "-h" && i + 1 < argc)
+        domainStep = atoi(argv[i + 1]);
+      else if (param == "-w" && i + 1 < argc)
+        searchRadius = atoi(argv[i + 1]);
+      else if (param == "-g" && i + 1 < argc)
+        searchFallback = atoi(argv[i + 1]);
+      else if (param == "-b" && i + 1 < argc)
+        flatTolerance = atof(argv[i + 1]);
+      else if (param == "-d" && i + 1 < argc)
+        cacheStep = atoi(argv[i + 1]);
+      else if (param == "-x" && i + 1 < argc)
+        rdLambda = atof(argv[i + 1]);
+      else if (param == "-y" && i + 1 < argc)
+        transformBudget = atoi(argv[i + 1]);
+      else if (param == "-q" && --i >= 0)
+        reportSearchLoss = true;
+      else if (param == "-i" && i + 1 < argc)
+        searchTile = atoi(argv[i + 1]);
+      else if (param == "-k" && i + 1 < argc)
+        kernelName = argv[i + 1];
+      else if (param == "-j" && i + 1 < argc)
+        threads = atoi(argv[i + 1]);
+      else if (param == "-a" && --i >= 0)
+        pinThreads = true;
+      else if (param == "-m" && --i >= 0)
+        concurrentChannels = true;
+      else if (param == "-l" && --i >= 0)
+        reuseLuma = true;
+      else if (param == "-u" && --i >= 0)
+        chromaSubsampling = true;
       else if (param == "-f" && --i >= 0)
         symmetry = true;
       else if (param == "-r" && --i >= 0)
@@ -201,10 +314,44 @@ int main(int argc, char **argv)
       return -1;
     }
 
+  if (maxBlockSize != 16 && maxBlockSize != 32 && maxBlockSize != 64)
+    {
+      printf("Error: The largest range block must be 16, 32 or 64 pixels.\n");
+      return -1;
+    }
+
+  if (!SelectKernels(kernelName))
+    {
+      printf("Error: Kernels '%s' are not available on this CPU.\n", kernelName.c_str());
+      return -1;
+    }
+  printf("Using %s kernels\n", kernels.name);
+
   source = new Image(fileName);
   enc = new QuadTreeEncoder(threshhold, symmetry);
-
-  Convert(enc, source, phases, output);
+  enc->maxBlockSize = maxBlockSize;
+  enc->searchMode = (QuadTreeEncoder::SEARCH)searchMode;
+  enc->searchClasses = searchClasses;
+  enc->searchNeighbors = searchNeighbors;
+  enc->searchCandidates = searchCandidates;
+  enc->domainStep = domainStep;
+  enc->searchTile = searchTile;
+  enc->searchRadius = searchRadius;
+  enc->searchFallback = searchFallback;
+  enc->flatTolerance = flatTolerance;
+  enc->cacheStep = cacheStep;
+  enc->rdLambda = rdLambda;
+  enc->transformBudget = transformBudget;
+  enc->threads = threads;
+  enc->pinThreads = pinThreads;
+  enc->concurrentChannels = concurrentChannels;
+  enc->reuseLuma = reuseLuma;
+  enc->chromaSubsampling = chromaSubsampling;
+
+  double psnr = Convert(enc, source, phases, output);
+
+  if (reportSearchLoss && searchRadius > 0)
+    ReportSearchLoss(enc, source, phases, psnr);
 
   delete enc;
   delete source;
@@ -212,13 +359,35 @@ int main(int argc, char **argv)
 
 void printUsage(char *exe)
 {
-  printf("Usage: %s [-v #] [-t #] [-p #] [-o #] [-f] [-r] filename\n"
+  printf("Usage: %s [-v #] [-t #] [-p #] [-o #] [-z #] [-s #] [-c #] [-n #] [-e #] [-h #] [-w #] [-g #] [-q] [-b #] [-d #] [-x #] [-y #] [-i #] [-k name] [-j #] [-a] [-m] [-l] [-u] [-f] [-r] filename\n"
          "\t-v 0    Verbous level (0-4)\n"
          "\t-t 100  Threshold (i.e. quality)\n"
          "\t-p 5    Number of decoding phases\n"
          "\t-o 1    1:Output final image,\n"
          "\t        2:Output at each phase,\n"
          "\t        3:Output at each phase & channel\n"
+         "\t-z 16   Largest range block: 16, 32 or 64\n"
+         "\t-s 0    Domain search: 0:Full, 1:Classified, 2:kd-tree,\n"
+         "\t        3:Coarse to fine, 4:FFT over every domain position (32+ pixels)\n"
+         "\t-c 1    Classes visited per range block (1-24, with -s 1)\n"
+         "\t-n 16   Nearest domains tested per range block (with -s 2)\n"
+         "\t-e 8    Candidates kept per pyramid level (with -s 3)\n"
+         "\t-h 0    Domain step in downsampled pixels (0: block size, no overlap)\n"
+         "\t-w 0    Domain search radius in pixels (0: whole image, with -s 0)\n"
+         "\t-g 0    Fallback domains from the whole image (with -w)\n"
+         "\t-q      Report the PSNR lost to the search radius (encodes again)\n"
+         "\t-b 0    Variance up to which a block is stored flat, unsearched\n"
+         "\t        (-1: always search)\n"
+         "\t-d 0    Reuse matches of blocks equal up to this step (0: off)\n"
+         "\t-x 0    Rate-distortion lambda, error per transform (0: threshold)\n"
+         "\t-y 0    Transform budget for all channels (0: none)\n"
+         "\t-i 0    Range blocks per cache-blocked search tile (0: depth first)\n"
+         "\t-k auto Pixel kernels: auto, scalar, sse4, avx2, avx512\n"
+         "\t-j 0    Encoder threads (0: one per CPU)\n"
+         "\t-a      Pin each encoder thread to its own CPU\n"
+         "\t-m      Encode all channels concurrently\n"
+         "\t-l      Start chroma blocks from the luma block's domain\n"
+         "\t-u      Encode chroma at half resolution (4:2:0, YCbCr only)\n"
          "\t-f      Force symmetry operations during encoding\n"
          "\t-r      Enable RGB instead of YCbCr\n",
          exe
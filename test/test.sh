@@ -25,5 +25,56 @@ check (){
     fi
 }
 
+# Encode in.rgb with two sets of options, which must give the same image.
+# Skipped when the CPU lacks the kernels the second one asks for.
+same () {
+    ./../fractal -o 1 -t 100 -p 5 $1 in.rgb > /dev/null
+    mv output.raw first.raw
+    ./../fractal -o 1 -t 100 -p 5 $2 in.rgb | grep -q "not available"
+    if [ $? -eq 0 ]; then
+        echo "SKIP: $2"
+    elif ! cmp -s first.raw output.raw; then
+        echo "FAIL: $1 / $2"
+    else
+        echo "OK: $1 / $2"
+    fi
+    rm -f first.raw output.raw
+}
+
 run lena256.jpg "256x256"
 check lena256.jpg
+
+convert -depth 8 -size 256x256 lena256.jpg in.rgb
+# The level-by-level search schedule finds the depth first partition
+same "" "-i 16"
+same "-x 50" "-x 50 -i 16"
+same "-x 50 -y 20000" "-x 50 -y 20000 -i 64"
+# Visiting every class is the full search
+same "" "-s 1 -c 24"
+# The thread count does not change the output
+same "-j 1" "-j 4"
+same "-j 1 -f" "-j 3 -a -m -f"
+same "-d 3 -j 1" "-d 3 -j 4"
+same "-d 3 -j 1" "-d 3 -i 16 -j 4"
+# Every kernel set gives the output of the scalar kernels
+for k in sse4 avx2 avx512; do
+    same "-k scalar" "-k $k"
+    same "-k scalar -f -i 16 -x 50" "-k $k -f -i 16 -x 50"
+done
+# The bounded search window
+same "-w 64 -g 4" "-w 64 -g 4 -i 16"
+# Flat blocks are found before any search
+same "-b 5" "-b 5 -i 16"
+same "-b 5 -x 50" "-b 5 -x 50 -i 16 -j 4"
+# Overlapping domains, read in place by every search path
+same "-h 2" "-h 2 -i 16"
+same "-f -h 3" "-f -h 3 -i 16"
+# The other searches, block sizes and chroma options, each against a
+# schedule or thread count that must not change them
+same "-s 2 -j 1" "-s 2 -j 4"
+same "-s 3 -z 32" "-s 3 -z 32 -i 16"
+same "-s 4 -z 64" "-s 4 -z 64 -i 16 -j 3"
+# The FFT finds the same domains as the direct search over every position
+same "-z 64 -h 1 -i 16" "-z 64 -s 4 -h 1"
+same "-u -l" "-u -l -m -j 4"
+rm in.rgb